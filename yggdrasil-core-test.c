@@ -0,0 +1,358 @@
+/**
+ * yggdrasil-core-test
+ *
+ * Unit tests of the parts of yggdrasil-core that need neither the network
+ * nor a main loop. Run by make check.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "yggdrasil-core.h"
+
+/*
+ * local echoes
+ */
+
+/* someone else quoting us is not the station's copy of what we said */
+static void test_echo_quoted(void) {
+  GQueue *echoes = g_queue_new();
+
+  g_queue_push_tail(echoes, yggdrasil_echo_new(1, "Alice", "hi"));
+
+  g_assert_cmpuint(yggdrasil_echo_match(echoes, "bob: alice said hi"), ==, 0);
+  g_assert_cmpuint(yggdrasil_echo_match(echoes, "bob: hi"), ==, 0);
+  g_assert_cmpuint(yggdrasil_echo_match(echoes, "alice: hi there"), ==, 0);
+  g_assert_cmpuint(g_queue_get_length(echoes), ==, 1);
+
+  g_assert_cmpuint(yggdrasil_echo_match(echoes, "<b>alice</b>: hi"), ==, 1);
+  g_assert_cmpuint(g_queue_get_length(echoes), ==, 0);
+
+  g_queue_free_full(echoes, yggdrasil_echo_free);
+}
+
+/* the station's copy is escaped whether or not the message was */
+static void test_echo_escaped(void) {
+  GQueue *echoes = g_queue_new();
+
+  g_queue_push_tail(echoes, yggdrasil_echo_new(1, "alice", "fish & chips"));
+  g_queue_push_tail(echoes, yggdrasil_echo_new(2, "alice",
+                                               "salt &amp; vinegar"));
+
+  g_assert_cmpuint(yggdrasil_echo_match(echoes, "alice: fish &amp; chips"),
+                   ==, 1);
+  g_assert_cmpuint(yggdrasil_echo_match(echoes, "alice: salt &amp; vinegar"),
+                   ==, 2);
+  g_assert_cmpuint(g_queue_get_length(echoes), ==, 0);
+
+  g_queue_free_full(echoes, yggdrasil_echo_free);
+}
+
+/* messages sent as one write come back as one line, which is their echo */
+static void test_echo_merged(void) {
+  const char *body = "<div>\n<b>alice</b>: a / b&amp;c<br>\n</div>\n";
+  GQueue *echoes = g_queue_new();
+  YggdrasilArena arena;
+  GPtrArray *window = g_ptr_array_new();
+
+  memset(&arena, 0, sizeof(arena));
+  g_queue_push_tail(echoes, yggdrasil_echo_new(3, "alice", "a"));
+  g_queue_push_tail(echoes, yggdrasil_echo_new(4, "alice", "b&amp;c"));
+  g_queue_push_tail(echoes, yggdrasil_echo_new(5, "alice", "later"));
+  yggdrasil_echo_merge(echoes, "alice", 3, 4, "a / b&amp;c");
+  g_assert_cmpuint(g_queue_get_length(echoes), ==, 2);
+
+  yggdrasil_parse_chat_window(&arena, body, NULL, window);
+  g_assert_cmpuint(window->len, ==, 1);
+  g_assert_cmpuint(yggdrasil_echo_match(echoes,
+                                        g_ptr_array_index(window, 0)), ==, 3);
+  g_assert_cmpuint(g_queue_get_length(echoes), ==, 1);
+  g_assert_cmpuint(((YggdrasilEcho *)g_queue_peek_head(echoes))->id, ==, 5);
+
+  g_ptr_array_free(window, TRUE);
+  yggdrasil_arena_clear(&arena);
+  g_queue_free_full(echoes, yggdrasil_echo_free);
+}
+
+/*
+ * privacy filtering
+ */
+
+/* a name too long to be a nick is on no list, so a permit list drops it */
+static void test_filter_long_speaker(void) {
+  YggdrasilFilter *permit = yggdrasil_filter_new(TRUE);
+  YggdrasilFilter *ignore = yggdrasil_filter_new(FALSE);
+  char *nick = g_strnfill(YGGDRASIL_NICK_MAX + 1, 'a');
+  char *line = g_strdup_printf("<b>%s</b>: hi", nick);
+
+  yggdrasil_filter_add(permit, "alice");
+  yggdrasil_filter_add(ignore, "alice");
+
+  g_assert_false(yggdrasil_filter_allows(permit, nick, strlen(nick)));
+  g_assert_false(yggdrasil_filter_allows_line(permit, line, strlen(line)));
+  g_assert_true(yggdrasil_filter_allows(ignore, nick, strlen(nick)));
+  g_assert_true(yggdrasil_filter_allows_line(ignore, line, strlen(line)));
+  g_assert_true(yggdrasil_filter_allows_line(permit, "alice: hi", 9));
+
+  g_free(line);
+  g_free(nick);
+  yggdrasil_filter_free(ignore);
+  yggdrasil_filter_free(permit);
+}
+
+/*
+ * the diff engine
+ */
+
+#define HISTORY_TEST_LINES 8
+
+/* lists end at the first NULL */
+typedef struct {
+  const char *path;
+  const char *history[HISTORY_TEST_LINES];
+  const char *window[HISTORY_TEST_LINES];
+  guint first_new;
+  const char *retracted[HISTORY_TEST_LINES];
+} HistoryTest;
+
+static const HistoryTest history_tests[] = {
+  { "/history/unchanged",
+    { "a: 1", "b: 2", "c: 3" },
+    { "a: 1", "b: 2", "c: 3" },
+    3, { NULL } },
+  { "/history/slid",
+    { "a: 1", "b: 2", "c: 3" },
+    { "b: 2", "c: 3", "d: 4", "e: 5" },
+    2, { NULL } },
+  { "/history/disjoint",
+    { "a: 1", "b: 2" },
+    { "c: 3", "d: 4" },
+    0, { NULL } },
+  { "/history/repeated-last",
+    { "a: hi", "b: lol" },
+    { "a: hi", "b: lol", "b: lol" },
+    2, { NULL } },
+  { "/history/repeated-after-new",
+    { "a: 1", "b: lol" },
+    { "a: 1", "b: lol", "c: 3", "b: lol" },
+    2, { NULL } },
+  { "/history/undo-middle",
+    { "a: 1", "b: 2", "c: 3", "d: 4" },
+    { "a: 1", "b: 2", "d: 4", "e: 5" },
+    3, { "c: 3" } },
+  { "/history/undo-last",
+    { "z: 0", "a: 1", "b: 2", "c: 3" },
+    { "z: 0", "a: 1", "b: 2" },
+    3, { "c: 3" } },
+  { "/history/undo-repeated",
+    { "a: 1", "b: lol", "c: 3" },
+    { "a: 1", "b: lol", "b: lol" },
+    2, { "c: 3" } },
+  { "/history/all-same",
+    { "b: lol", "b: lol", "b: lol" },
+    { "b: lol", "b: lol", "b: lol", "b: lol" },
+    3, { NULL } },
+  { "/history/all-same-unchanged",
+    { "b: lol", "b: lol", "b: lol" },
+    { "b: lol", "b: lol", "b: lol" },
+    3, { NULL } },
+};
+
+static void test_history_delta(gconstpointer data) {
+  const HistoryTest *test = (const HistoryTest *)data;
+  GQueue *history = g_queue_new();
+  GPtrArray *window = g_ptr_array_new();
+  GList *retracted = NULL, *l;
+  guint i;
+
+  for (i = 0; i < HISTORY_TEST_LINES && test->history[i]; i++)
+    yggdrasil_history_append(history, test->history[i], 0);
+  for (i = 0; i < HISTORY_TEST_LINES && test->window[i]; i++)
+    g_ptr_array_add(window, (gpointer)test->window[i]);
+
+  g_assert_cmpuint(yggdrasil_history_delta(history, window, &retracted), ==,
+                   test->first_new);
+
+  for (l = retracted, i = 0; l; l = l->next, i++) {
+    g_assert_cmpuint(i, <, HISTORY_TEST_LINES);
+    g_assert_cmpstr(((YggdrasilLine *)l->data)->text, ==, test->retracted[i]);
+  }
+  g_assert_true(i == HISTORY_TEST_LINES || !test->retracted[i]);
+
+  /* what's left of the history is what the window holds before first_new */
+  for (l = history->tail, i = test->first_new; l && i > 0; l = l->prev, i--)
+    g_assert_cmpstr(((YggdrasilLine *)l->data)->text, ==,
+                    test->window[i - 1]);
+
+  g_list_free_full(retracted, yggdrasil_line_free);
+  g_ptr_array_free(window, TRUE);
+  g_queue_free_full(history, yggdrasil_line_free);
+}
+
+/*
+ * the archive and its word index
+ */
+
+/* an archive in a fresh directory, and the names to clean up after it */
+typedef struct {
+  char *dir;
+  char *path;
+  char *index_path;
+} ArchiveFixture;
+
+static void archive_fixture_set_up(ArchiveFixture *fixture,
+                                   const char *contents) {
+  fixture->dir = g_dir_make_tmp("yggdrasil-core-test-XXXXXX", NULL);
+  g_assert_true(fixture->dir != NULL);
+  fixture->path = g_build_filename(fixture->dir, "test.archive", NULL);
+  fixture->index_path = g_strdup_printf("%s.idx", fixture->path);
+  if (contents)
+    g_assert_true(g_file_set_contents(fixture->path, contents, -1, NULL));
+}
+
+static void archive_fixture_tear_down(ArchiveFixture *fixture) {
+  g_unlink(fixture->path);
+  g_unlink(fixture->index_path);
+  g_rmdir(fixture->dir);
+  g_free(fixture->index_path);
+  g_free(fixture->path);
+  g_free(fixture->dir);
+}
+
+static void archive_collect(time_t mtime, const char *text,
+                            gpointer userdata) {
+  g_ptr_array_add((GPtrArray *)userdata, g_strdup(text));
+}
+
+/* a record torn by a crash is cut off, not run on into by the next one */
+static void test_archive_torn_tail(void) {
+  ArchiveFixture fixture;
+  YggdrasilArchive *archive;
+  GPtrArray *lines = g_ptr_array_new_with_free_func(g_free);
+  char *contents;
+
+  archive_fixture_set_up(&fixture, "100\ta: 1\n200\tb: 2\n300\tc: ");
+  archive = yggdrasil_archive_open(fixture.path);
+  yggdrasil_archive_append(archive, 400, "d: 4");
+  yggdrasil_archive_flush(archive, TRUE);
+
+  g_assert_true(g_file_get_contents(fixture.path, &contents, NULL, NULL));
+  g_assert_cmpstr(contents, ==, "100\ta: 1\n200\tb: 2\n400\td: 4\n");
+  g_free(contents);
+
+  g_assert_cmpint(yggdrasil_archive_query(archive, 0, 1000, 10,
+                                          archive_collect, lines), ==, 3);
+  g_assert_cmpstr(g_ptr_array_index(lines, 2), ==, "d: 4");
+
+  yggdrasil_archive_close(archive);
+  g_ptr_array_free(lines, TRUE);
+  archive_fixture_tear_down(&fixture);
+}
+
+static void index_expect(YggdrasilSearchIndex *index,
+                         YggdrasilArchive *archive, const char *words,
+                         const char *first, const char *last) {
+  GArray *matches = yggdrasil_index_search(index, words);
+  GPtrArray *lines = g_ptr_array_new_with_free_func(g_free);
+
+  yggdrasil_archive_read_at(archive, (const gint64 *)matches->data,
+                            matches->len, archive_collect, lines);
+  g_assert_cmpuint(lines->len, ==, matches->len);
+  if (!first) {
+    g_assert_cmpuint(lines->len, ==, 0);
+  } else {
+    g_assert_cmpuint(lines->len, >, 0);
+    g_assert_cmpstr(g_ptr_array_index(lines, 0), ==, first);
+    g_assert_cmpstr(g_ptr_array_index(lines, lines->len - 1), ==, last);
+  }
+
+  g_ptr_array_free(lines, TRUE);
+  g_array_free(matches, TRUE);
+}
+
+/* the index is built in the background, catching up with lines archived
+ * meanwhile, and is kept up to date after that */
+static void test_index_build(void) {
+  ArchiveFixture fixture;
+  YggdrasilArchive *archive;
+  YggdrasilSearchIndex *index = yggdrasil_index_new();
+  gint64 offset;
+  int i;
+
+  archive_fixture_set_up(&fixture, NULL);
+  archive = yggdrasil_archive_open(fixture.path);
+  for (i = 0; i < 5000; i++) {
+    char *line = g_strdup_printf("a: line %d%s", i, i % 1000 ? "" : " fish");
+    yggdrasil_archive_append(archive, 100 + i, line);
+    g_free(line);
+  }
+
+  yggdrasil_index_build(index, archive);
+  g_assert_false(yggdrasil_index_built(index));
+  yggdrasil_archive_append(archive, 6000, "b: Fish and chips");
+
+  while (!yggdrasil_index_built(index))
+    g_main_context_iteration(NULL, TRUE);
+  index_expect(index, archive, "fish", "a: line 0 fish", "b: Fish and chips");
+  index_expect(index, archive, "line 4000", "a: line 4000 fish",
+               "a: line 4000 fish");
+  index_expect(index, archive, "chips line", NULL, NULL);
+
+  offset = yggdrasil_archive_append(archive, 6001, "c: more fish");
+  yggdrasil_index_add(index, offset, "c: more fish", strlen("c: more fish"));
+  index_expect(index, archive, "FISH", "a: line 0 fish", "c: more fish");
+
+  yggdrasil_index_free(index);
+  yggdrasil_archive_close(archive);
+  archive_fixture_tear_down(&fixture);
+}
+
+/* the index is built from the main loop */
+static const YggdrasilCoreOps test_ops = {
+  g_timeout_add,
+  g_timeout_add_seconds,
+  g_source_remove,
+  NULL,
+  g_source_remove,
+  NULL,
+  NULL,
+  "yggdrasil-core-test"
+};
+
+int main(int argc, char *argv[]) {
+  guint i;
+  int status;
+
+  g_test_init(&argc, &argv, NULL);
+  yggdrasil_core_init(&test_ops);
+
+  g_test_add_func("/echo/quoted", test_echo_quoted);
+  g_test_add_func("/echo/escaped", test_echo_escaped);
+  g_test_add_func("/echo/merged", test_echo_merged);
+  g_test_add_func("/filter/long-speaker", test_filter_long_speaker);
+  for (i = 0; i < G_N_ELEMENTS(history_tests); i++)
+    g_test_add_data_func(history_tests[i].path, &history_tests[i],
+                         test_history_delta);
+  g_test_add_func("/archive/torn-tail", test_archive_torn_tail);
+  g_test_add_func("/index/build", test_index_build);
+
+  status = g_test_run();
+  yggdrasil_core_shutdown();
+  return status;
+}
@@ -0,0 +1,2834 @@
+/**
+ * yggdrasil-core
+ *
+ * The libpurple-free half of yggdrasilprpl; see yggdrasil-core.h.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <curl/curl.h>
+#include <glib.h>
+#ifdef G_OS_UNIX
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include "yggdrasil-core.h"
+
+/* the archive is fsynced every YGGDRASIL_ARCHIVE_FLUSH_LINES lines or
+ * YGGDRASIL_ARCHIVE_FLUSH_INTERVAL seconds, whichever comes first, and its
+ * index holds one entry per YGGDRASIL_ARCHIVE_INDEX_STRIDE bytes */
+#define YGGDRASIL_ARCHIVE_FLUSH_LINES     64
+#define YGGDRASIL_ARCHIVE_FLUSH_INTERVAL  30
+#define YGGDRASIL_ARCHIVE_INDEX_STRIDE    4096
+
+/* the word index is built YGGDRASIL_INDEX_BUILD_LINES archived lines at a
+ * time, YGGDRASIL_INDEX_BUILD_INTERVAL ms apart, so the UI stays live */
+#define YGGDRASIL_INDEX_BUILD_LINES       2000
+#define YGGDRASIL_INDEX_BUILD_INTERVAL    10
+
+/* retries back off exponentially from YGGDRASIL_RETRY_BASE, with jitter */
+#define YGGDRASIL_RETRY_BASE        500    /* ms */
+#define YGGDRASIL_RETRY_MAX         8000   /* ms */
+
+/* an endpoint failing this many requests in a row is left alone, bar one
+ * probe per cool-down, until it answers again */
+#define YGGDRASIL_BREAKER_THRESHOLD   5
+#define YGGDRASIL_BREAKER_COOLDOWN    30    /* seconds, doubled per failed probe */
+#define YGGDRASIL_BREAKER_COOLDOWN_MAX  600
+
+/* at most this many lines are taken back out of the history per poll */
+#define YGGDRASIL_RETRACT_MAX   5
+
+/* local echoes the station hasn't repeated by then are given up on */
+#define YGGDRASIL_ECHO_TTL      300   /* seconds */
+
+/* blocks of the per-poll arena; bigger allocations get a block of their own */
+#define YGGDRASIL_ARENA_BLOCK   16384
+
+/*
+ * capture and replay of the fetch layer, for reproducing a session offline.
+ * YGGDRASIL_CAPTURE=file records every response; YGGDRASIL_REPLAY=file
+ * answers requests from such a recording instead of the network, sped up by
+ * YGGDRASIL_REPLAY_SPEED (default 1; 0 answers at once).
+ */
+#define YGGDRASIL_ENV_CAPTURE       "YGGDRASIL_CAPTURE"
+#define YGGDRASIL_ENV_REPLAY        "YGGDRASIL_REPLAY"
+#define YGGDRASIL_ENV_REPLAY_SPEED  "YGGDRASIL_REPLAY_SPEED"
+#define YGGDRASIL_CAPTURE_MAGIC     "yggdrasil-capture 1\n"
+
+/* however fast a replay goes, it polls no more often than this, so that
+ * once the capture is used up the failing polls don't spin */
+#define YGGDRASIL_REPLAY_POLL_MIN   10     /* ms */
+
+/*
+ * tls. YGGDRASIL_CA_FILE=file trusts the certificates in file instead of the
+ * system's, and YGGDRASIL_RESOLVE=host:port:address[,...] sends a host's
+ * requests elsewhere, e.g. to a stand-in server with a self-signed
+ * certificate.
+ */
+#define YGGDRASIL_ENV_CA_FILE       "YGGDRASIL_CA_FILE"
+#define YGGDRASIL_ENV_RESOLVE       "YGGDRASIL_RESOLVE"
+
+/* YGGDRASIL_METRICS=path serves the metrics on a unix socket at path */
+#define YGGDRASIL_ENV_METRICS       "YGGDRASIL_METRICS"
+
+/* YGGDRASIL_WATCHDOG=ms logs main-loop callbacks that take longer than ms */
+#define YGGDRASIL_ENV_WATCHDOG      "YGGDRASIL_WATCHDOG"
+#define YGGDRASIL_WATCHDOG_DEPTH    8     /* nested stages timed */
+#define YGGDRASIL_WATCHDOG_WINDOW   256   /* latest callbacks in the histogram */
+
+#define CURL_MAX_BUF	65536
+
+static const YggdrasilCoreOps *core_ops = NULL;
+
+static void core_debug(gboolean error, const char *format, va_list args) {
+  char *message;
+
+  if (!core_ops || !core_ops->debug)
+    return;
+  message = g_strdup_vprintf(format, args);
+  core_ops->debug(error, message);
+  g_free(message);
+}
+
+static void core_debug_info(const char *format, ...) G_GNUC_PRINTF(1, 2);
+static void core_debug_info(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  core_debug(FALSE, format, args);
+  va_end(args);
+}
+
+static void core_debug_error(const char *format, ...) G_GNUC_PRINTF(1, 2);
+static void core_debug_error(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  core_debug(TRUE, format, args);
+  va_end(args);
+}
+
+const YggdrasilFetchPolicy yggdrasil_fetch_policy_login = { 10, 30, 2, TRUE };
+const YggdrasilFetchPolicy yggdrasil_fetch_policy_poll  = {  5, 15, 1, TRUE };
+const YggdrasilFetchPolicy yggdrasil_fetch_policy_write = {  5, 20, 2, FALSE };
+
+typedef enum {
+  YGGDRASIL_BREAKER_CLOSED = 0,  /* requests flow */
+  YGGDRASIL_BREAKER_OPEN,        /* requests fail fast until retry_at */
+  YGGDRASIL_BREAKER_HALF_OPEN    /* one probe is in flight */
+} YggdrasilBreakerState;
+
+/* circuit breaker of one endpoint, i.e. a url up to its query string */
+typedef struct {
+  char *endpoint;
+  YggdrasilBreakerState state;
+  int failures;                  /* consecutive */
+  int cooldown;                  /* seconds */
+  gint64 retry_at;               /* monotonic time of the next probe */
+} YggdrasilBreaker;
+
+struct _YggdrasilFetch {
+  CURL *easy;
+  GString *body;
+  char error[CURL_ERROR_SIZE];
+  YggdrasilFetchCallback callback;
+  gpointer userdata;
+
+  const YggdrasilFetchPolicy *policy;
+  YggdrasilBreaker *breaker;
+  int attempts;                  /* made so far */
+  gboolean in_multi;
+  gboolean probe;                /* the half-open breaker's probe */
+  guint timer;                   /* pending retry, fail-fast or replay */
+
+  char *url;
+  gboolean prewarm;              /* a HEAD request to open a connection */
+  gint64 started;                /* monotonic time of the first attempt */
+  struct _YggdrasilCaptureRecord *replay;   /* the recorded answer */
+};
+
+/*
+ * one response in a capture file, stored as
+ *   start<TAB>duration<TAB>status<TAB>length<TAB>url<LF>body<LF>
+ * with times in ms since the capture began. status is -1 when the transfer
+ * failed, and body is then the error. credentials in the url are masked.
+ */
+typedef struct _YggdrasilCaptureRecord {
+  char *url;
+  gint64 start;
+  gint64 duration;
+  long status;
+  char *body;
+  gsize len;
+} YggdrasilCaptureRecord;
+
+static FILE *capture_file = NULL;
+static gint64 capture_epoch = 0;
+static GHashTable *replay_records = NULL;   /* endpoint -> GQueue of records */
+static double replay_speed = 1.0;
+
+static void capture_write(YggdrasilFetch *fetch, long status,
+                          const char *body, gsize len);
+
+/*
+ * every transfer runs on fetch_multi, whose connection cache keeps
+ * connections to the station alive between polls; fetch_share hands tls
+ * sessions and dns answers from one transfer to the next, so that a new
+ * connection resumes its session instead of doing a full handshake.
+ */
+static CURLM *fetch_multi = NULL;
+static CURLSH *fetch_share = NULL;
+static char *fetch_ca_file = NULL;
+static struct curl_slist *fetch_resolve = NULL;
+static guint fetch_multi_timer = 0;
+static GHashTable *fetch_breakers = NULL;   /* endpoint -> YggdrasilBreaker */
+
+/*
+ * the append-only archive of everything read from the intercom: a segment
+ * file of "mtime<TAB>text" lines, and a sidecar index of
+ * YggdrasilArchiveEntries pointing into it at every page or so, in time
+ * order. queries map both and touch only the pages they need.
+ */
+typedef struct {
+  gint64 mtime;                  /* of the record at offset */
+  gint64 offset;
+} YggdrasilArchiveEntry;
+
+struct _YggdrasilArchive {
+  char *path;                    /* segment */
+  char *index_path;
+  int fd;
+  int index_fd;
+  gint64 size;                   /* of the segment, pending bytes included */
+  gint64 last_indexed;           /* offset of the last index entry, or -1 */
+  time_t last_mtime;
+  GString *pending;              /* segment bytes not yet written */
+  GString *pending_index;
+  int pending_lines;
+  guint flush_timer;
+};
+
+/*
+ * full-text search over the archive: an inverted index from lowercased
+ * token to the ascending segment offsets of the records that contain it.
+ * built from the archive on the first /search, then kept up to date as new
+ * lines are archived.
+ */
+struct _YggdrasilSearchIndex {
+  GHashTable *postings;          /* token -> GArray of gint64 offsets */
+  gboolean built;
+
+  /* while it's being built */
+  YggdrasilArchive *archive;
+  GMappedFile *segment;
+  gint64 next;                   /* offset of the next record to index */
+  guint build_timer;
+  int records;
+};
+
+typedef struct {
+  gsize size;
+  char data[];
+} YggdrasilArenaBlock;
+
+/*
+ * the per-poll arena
+ */
+gpointer yggdrasil_arena_alloc(YggdrasilArena *arena, gsize n) {
+  YggdrasilArenaBlock *block = arena->blocks ? arena->blocks->data : NULL;
+  gpointer p;
+
+  n = (n + 7) & ~(gsize)7;
+  if (!block || arena->used + n > block->size) {
+    if (n <= YGGDRASIL_ARENA_BLOCK && arena->spare) {
+      block = arena->spare->data;
+      arena->spare = g_slist_delete_link(arena->spare, arena->spare);
+    } else {
+      gsize size = MAX(n, YGGDRASIL_ARENA_BLOCK);
+      block = g_malloc(sizeof(YggdrasilArenaBlock) + size);
+      block->size = size;
+    }
+    arena->blocks = g_slist_prepend(arena->blocks, block);
+    arena->used = 0;
+  }
+
+  p = block->data + arena->used;
+  arena->used += n;
+  return p;
+}
+
+char *yggdrasil_arena_strndup(YggdrasilArena *arena, const char *str,
+                              gsize len) {
+  char *copy = yggdrasil_arena_alloc(arena, len + 1);
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+  return copy;
+}
+
+/* releases everything allocated since the last reset */
+void yggdrasil_arena_reset(YggdrasilArena *arena) {
+  while (arena->blocks) {
+    YggdrasilArenaBlock *block = arena->blocks->data;
+    if (block->size == YGGDRASIL_ARENA_BLOCK)
+      arena->spare = g_slist_prepend(arena->spare, block);
+    else
+      g_free(block);
+    arena->blocks = g_slist_delete_link(arena->blocks, arena->blocks);
+  }
+  arena->used = 0;
+}
+
+void yggdrasil_arena_clear(YggdrasilArena *arena) {
+  yggdrasil_arena_reset(arena);
+  g_slist_free_full(arena->spare, g_free);
+  arena->spare = NULL;
+}
+
+/*
+ * interned nicknames, shared by every connection
+ */
+static GHashTable *nick_table = NULL;       /* name -> YggdrasilNick */
+static guint nick_next_id = 1;
+
+/* returns a new reference to the nick for name, interning it if need be */
+YggdrasilNick *yggdrasil_nick_intern(const char *name) {
+  YggdrasilNick *nick;
+
+  if (!nick_table)
+    nick_table = g_hash_table_new(g_str_hash, g_str_equal);
+
+  nick = g_hash_table_lookup(nick_table, name);
+  if (!nick) {
+    nick = g_new0(YggdrasilNick, 1);
+    nick->name = g_strdup(name);
+    nick->id = nick_next_id++;
+    g_hash_table_insert(nick_table, nick->name, nick);
+  }
+  nick->refs++;
+  return nick;
+}
+
+/* the nick for name if it's interned, without taking a reference */
+YggdrasilNick *yggdrasil_nick_lookup(const char *name) {
+  return nick_table ? g_hash_table_lookup(nick_table, name) : NULL;
+}
+
+YggdrasilNick *yggdrasil_nick_ref(YggdrasilNick *nick) {
+  nick->refs++;
+  return nick;
+}
+
+void yggdrasil_nick_unref(gpointer data) {
+  YggdrasilNick *nick = (YggdrasilNick *)data;
+
+  if (--nick->refs)
+    return;
+  g_hash_table_remove(nick_table, nick->name);
+  g_free(nick->name);
+  g_free(nick);
+}
+
+/*
+ * http fetches
+ */
+static void capture_record_free(gpointer data) {
+  YggdrasilCaptureRecord *record = (YggdrasilCaptureRecord *)data;
+  g_free(record->url);
+  g_free(record->body);
+  g_free(record);
+}
+
+static void fetch_free(YggdrasilFetch *fetch) {
+  if (fetch->easy)
+    curl_easy_cleanup(fetch->easy);
+  if (fetch->replay)
+    capture_record_free(fetch->replay);
+  g_string_free(fetch->body, TRUE);
+  g_free(fetch->url);
+  g_free(fetch);
+}
+
+static size_t fetch_write_fn(char *ptr, size_t size, size_t nmemb,
+                             void *userdata) {
+  YggdrasilFetch *fetch = (YggdrasilFetch *)userdata;
+  size_t len = size * nmemb;
+
+  if (fetch->body->len + len > CURL_MAX_BUF) {
+    g_snprintf(fetch->error, sizeof(fetch->error),
+               "response larger than %d bytes", CURL_MAX_BUF);
+    return 0;  /* aborts the transfer with CURLE_WRITE_ERROR */
+  }
+  g_string_append_len(fetch->body, ptr, len);
+  return len;
+}
+
+static void breaker_changed(YggdrasilBreaker *breaker) {
+  if (core_ops->breaker_changed)
+    core_ops->breaker_changed(breaker->endpoint,
+                              breaker->state != YGGDRASIL_BREAKER_CLOSED,
+                              breaker->cooldown);
+}
+
+static void breaker_free(gpointer data) {
+  YggdrasilBreaker *breaker = (YggdrasilBreaker *)data;
+  g_free(breaker->endpoint);
+  g_free(breaker);
+}
+
+static YggdrasilBreaker *breaker_get(const char *url) {
+  const char *query = strchr(url, '?');
+  char *endpoint = query ? g_strndup(url, query - url) : g_strdup(url);
+  YggdrasilBreaker *breaker;
+
+  if (!fetch_breakers)
+    /* keys are owned by their breakers */
+    fetch_breakers = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                           NULL, breaker_free);
+
+  breaker = g_hash_table_lookup(fetch_breakers, endpoint);
+  if (breaker) {
+    g_free(endpoint);
+  } else {
+    breaker = g_new0(YggdrasilBreaker, 1);
+    breaker->endpoint = endpoint;
+    breaker->cooldown = YGGDRASIL_BREAKER_COOLDOWN;
+    g_hash_table_insert(fetch_breakers, breaker->endpoint, breaker);
+  }
+  return breaker;
+}
+
+static void breaker_open(YggdrasilBreaker *breaker) {
+  breaker->state = YGGDRASIL_BREAKER_OPEN;
+  breaker->retry_at = g_get_monotonic_time() +
+                      breaker->cooldown * (gint64)G_USEC_PER_SEC;
+  core_debug_error("%s is failing; probing it again in %d seconds\n",
+                   breaker->endpoint, breaker->cooldown);
+}
+
+/* updates the breaker with the outcome of a request, retries included */
+static void breaker_record(YggdrasilBreaker *breaker, gboolean ok) {
+  if (ok) {
+    gboolean was_open = breaker->state != YGGDRASIL_BREAKER_CLOSED;
+    breaker->state = YGGDRASIL_BREAKER_CLOSED;
+    breaker->failures = 0;
+    breaker->cooldown = YGGDRASIL_BREAKER_COOLDOWN;
+    if (was_open) {
+      core_debug_info("%s is answering again\n", breaker->endpoint);
+      breaker_changed(breaker);
+    }
+    return;
+  }
+
+  breaker->failures++;
+  if (breaker->state == YGGDRASIL_BREAKER_HALF_OPEN) {
+    breaker->cooldown = MIN(breaker->cooldown * 2,
+                            YGGDRASIL_BREAKER_COOLDOWN_MAX);
+    breaker_open(breaker);
+  } else if (breaker->state == YGGDRASIL_BREAKER_CLOSED &&
+             breaker->failures >= YGGDRASIL_BREAKER_THRESHOLD) {
+    breaker_open(breaker);
+    breaker_changed(breaker);
+  }
+}
+
+/* returns the ms to wait before the next attempt: exponential backoff
+ * with "equal jitter", half fixed and half random */
+static guint fetch_backoff(int attempt) {
+  guint backoff = YGGDRASIL_RETRY_BASE << MIN(attempt, 10);
+  backoff = MIN(backoff, YGGDRASIL_RETRY_MAX);
+  return backoff / 2 + g_random_int_range(0, backoff / 2 + 1);
+}
+
+static void fetch_attempt(YggdrasilFetch *fetch) {
+  g_string_truncate(fetch->body, 0);
+  fetch->error[0] = '\0';
+  fetch->attempts++;
+  fetch->in_multi = TRUE;
+  curl_multi_add_handle(fetch_multi, fetch->easy);
+}
+
+static gboolean fetch_retry_cb(gpointer data) {
+  YggdrasilFetch *fetch = (YggdrasilFetch *)data;
+  YGGDRASIL_STAGE_ENTER(YGGDRASIL_STAGE_FETCH);
+  fetch->timer = 0;
+  fetch_attempt(fetch);
+  YGGDRASIL_STAGE_LEAVE(YGGDRASIL_STAGE_FETCH);
+  return FALSE;
+}
+
+static gboolean fetch_refused_cb(gpointer data) {
+  YggdrasilFetch *fetch = (YggdrasilFetch *)data;
+
+  YGGDRASIL_STAGE_ENTER(YGGDRASIL_STAGE_FETCH);
+  fetch->timer = 0;
+  g_snprintf(fetch->error, sizeof(fetch->error), "%s is not responding",
+             fetch->breaker->endpoint);
+  fetch->callback(fetch, fetch->userdata, NULL, 0, fetch->error);
+  fetch_free(fetch);
+  YGGDRASIL_STAGE_LEAVE(YGGDRASIL_STAGE_FETCH);
+  return FALSE;
+}
+
+/*
+ * dispatches the callbacks of every transfer libcurl reports as done.
+ * network errors and 5xx answers are retried as the fetch's policy allows
+ * before they count against the endpoint's breaker.
+ */
+static void fetch_check_done(void) {
+  CURLMsg *msg;
+  int pending;
+
+  while ((msg = curl_multi_info_read(fetch_multi, &pending))) {
+    YggdrasilFetch *fetch;
+    const char *error_message = NULL;
+    CURLcode result = msg->data.result;
+    long status = 0;
+    gboolean transient;
+
+    if (msg->msg != CURLMSG_DONE)
+      continue;
+
+    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&fetch);
+    curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &status);
+
+    curl_multi_remove_handle(fetch_multi, fetch->easy);
+    fetch->in_multi = FALSE;
+
+    transient = result != CURLE_OK || status >= 500;
+    if (transient && !fetch->probe &&
+        fetch->attempts <= fetch->policy->retries &&
+        (fetch->policy->idempotent || result == CURLE_COULDNT_RESOLVE_HOST ||
+         result == CURLE_COULDNT_CONNECT)) {
+      guint delay = fetch_backoff(fetch->attempts - 1);
+      core_debug_info("retrying %s in %u ms (attempt %d failed: %s)\n",
+                      fetch->breaker->endpoint, delay, fetch->attempts,
+                      result != CURLE_OK ? curl_easy_strerror(result)
+                                         : "server error");
+      fetch->timer = core_ops->timeout_add(delay, fetch_retry_cb, fetch);
+      continue;
+    }
+
+    breaker_record(fetch->breaker, !transient);
+    fetch->probe = FALSE;
+
+    if (result != CURLE_OK) {
+      error_message = fetch->error[0] ? fetch->error
+                                      : curl_easy_strerror(result);
+    } else if (status >= 400) {
+      g_snprintf(fetch->error, sizeof(fetch->error), "HTTP error %ld", status);
+      error_message = fetch->error;
+    }
+
+    if (capture_file && !fetch->prewarm) {
+      if (result != CURLE_OK)
+        capture_write(fetch, -1, error_message, strlen(error_message));
+      else
+        capture_write(fetch, status, fetch->body->str, fetch->body->len);
+    }
+
+    fetch->callback(fetch, fetch->userdata,
+                    error_message ? NULL : fetch->body->str,
+                    error_message ? 0 : fetch->body->len,
+                    error_message);
+    fetch_free(fetch);
+  }
+}
+
+static void fetch_socket_cb(gpointer data, gint fd,
+                            YggdrasilInputCondition cond) {
+  int action = 0;
+  int running;
+
+  if (cond & YGGDRASIL_INPUT_READ)
+    action |= CURL_CSELECT_IN;
+  if (cond & YGGDRASIL_INPUT_WRITE)
+    action |= CURL_CSELECT_OUT;
+
+  YGGDRASIL_STAGE_ENTER(YGGDRASIL_STAGE_FETCH);
+  curl_multi_socket_action(fetch_multi, fd, action, &running);
+  fetch_check_done();
+  YGGDRASIL_STAGE_LEAVE(YGGDRASIL_STAGE_FETCH);
+}
+
+/* CURLMOPT_SOCKETFUNCTION: mirror libcurl's interest in a socket onto the
+ * event loop. socketp holds the current input watch, if any. */
+static int fetch_socket_fn(CURL *easy, curl_socket_t s, int what,
+                           void *userp, void *socketp) {
+  guint *watch = (guint *)socketp;
+  YggdrasilInputCondition cond = 0;
+
+  if (watch && *watch) {
+    core_ops->input_remove(*watch);
+    *watch = 0;
+  }
+
+  if (what == CURL_POLL_REMOVE) {
+    g_free(watch);
+    curl_multi_assign(fetch_multi, s, NULL);
+    return 0;
+  }
+
+  if (!watch) {
+    watch = g_new0(guint, 1);
+    curl_multi_assign(fetch_multi, s, watch);
+  }
+
+  if (what & CURL_POLL_IN)
+    cond |= YGGDRASIL_INPUT_READ;
+  if (what & CURL_POLL_OUT)
+    cond |= YGGDRASIL_INPUT_WRITE;
+  *watch = core_ops->input_add(s, cond, fetch_socket_cb, NULL);
+  return 0;
+}
+
+static gboolean fetch_timeout_cb(gpointer data) {
+  int running;
+
+  YGGDRASIL_STAGE_ENTER(YGGDRASIL_STAGE_FETCH);
+  fetch_multi_timer = 0;
+  curl_multi_socket_action(fetch_multi, CURL_SOCKET_TIMEOUT, 0, &running);
+  fetch_check_done();
+  YGGDRASIL_STAGE_LEAVE(YGGDRASIL_STAGE_FETCH);
+  return FALSE;
+}
+
+/* CURLMOPT_TIMERFUNCTION: libcurl wants exactly one pending timer */
+static int fetch_timer_fn(CURLM *multi, long timeout_ms, void *userp) {
+  if (fetch_multi_timer) {
+    core_ops->timeout_remove(fetch_multi_timer);
+    fetch_multi_timer = 0;
+  }
+  if (timeout_ms >= 0)
+    fetch_multi_timer = core_ops->timeout_add(timeout_ms, fetch_timeout_cb,
+                                              NULL);
+  return 0;
+}
+
+/*
+ * capture and replay
+ */
+
+/* the url with the values of pwd= and auth= masked */
+static char *capture_mask_url(const char *url) {
+  GString *masked = g_string_new(NULL);
+  const char *p = url;
+
+  while (*p) {
+    const char *param = (p == url) ? NULL : p;
+    gsize n = strcspn(p, "&?");
+
+    g_string_append_len(masked, p, n);
+    if (param && (g_str_has_prefix(param, "pwd=") ||
+                  g_str_has_prefix(param, "auth="))) {
+      g_string_truncate(masked, masked->len - n + strcspn(param, "=") + 1);
+      g_string_append_c(masked, '*');
+    }
+    p += n;
+    if (*p)
+      g_string_append_c(masked, *p++);
+  }
+  return g_string_free(masked, FALSE);
+}
+
+static void capture_write(YggdrasilFetch *fetch, long status,
+                          const char *body, gsize len) {
+  char *url = capture_mask_url(fetch->url);
+  gint64 now = g_get_monotonic_time();
+
+  fprintf(capture_file, "%" G_GINT64_FORMAT "\t%" G_GINT64_FORMAT
+          "\t%ld\t%" G_GSIZE_FORMAT "\t%s\n",
+          (fetch->started - capture_epoch) / 1000,
+          (now - fetch->started) / 1000, status, len, url);
+  fwrite(body, 1, len, capture_file);
+  fputc('\n', capture_file);
+  fflush(capture_file);
+  g_free(url);
+}
+
+/* a url up to its query string, less its scheme, so that captures made
+ * over http replay over https */
+static char *capture_endpoint(const char *url) {
+  const char *host = strstr(url, "://");
+
+  if (host)
+    url = host + 3;
+  return g_strndup(url, strcspn(url, "?"));
+}
+
+static void replay_load(const char *path) {
+  char *contents, *p, *end;
+  gsize size;
+  int records = 0;
+
+  if (!g_file_get_contents(path, &contents, &size, NULL) ||
+      !g_str_has_prefix(contents, YGGDRASIL_CAPTURE_MAGIC)) {
+    core_debug_error("can't replay %s\n", path);
+    return;
+  }
+
+  replay_records = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                         NULL);
+  p = contents + strlen(YGGDRASIL_CAPTURE_MAGIC);
+  end = contents + size;
+  while (p < end) {
+    YggdrasilCaptureRecord *record;
+    char **fields;
+    char *eol = memchr(p, '\n', end - p);
+    char *endpoint;
+    gsize len;
+    GQueue *queue;
+
+    if (!eol)
+      break;
+    *eol = '\0';
+    fields = g_strsplit(p, "\t", 5);
+    if (g_strv_length(fields) != 5) {
+      g_strfreev(fields);
+      break;
+    }
+
+    len = g_ascii_strtoull(fields[3], NULL, 10);
+    if (len > (gsize)(end - eol - 1)) {
+      g_strfreev(fields);
+      break;  /* torn tail */
+    }
+    record = g_new0(YggdrasilCaptureRecord, 1);
+    record->start = g_ascii_strtoll(fields[0], NULL, 10);
+    record->duration = g_ascii_strtoll(fields[1], NULL, 10);
+    record->status = strtol(fields[2], NULL, 10);
+    record->url = g_strdup(fields[4]);
+    record->body = g_strndup(eol + 1, len);
+    record->len = len;
+    g_strfreev(fields);
+
+    endpoint = capture_endpoint(record->url);
+    queue = g_hash_table_lookup(replay_records, endpoint);
+    if (!queue) {
+      queue = g_queue_new();
+      g_hash_table_insert(replay_records, endpoint, queue);
+    } else {
+      g_free(endpoint);
+    }
+    g_queue_push_tail(queue, record);
+    records++;
+    p = eol + 1 + len + 1;
+  }
+
+  g_free(contents);
+  core_debug_info("replaying %d responses from %s at %gx\n", records, path,
+                  replay_speed);
+}
+
+/* reads the capture and replay settings from the environment, once */
+static void capture_init(void) {
+  const char *capture = g_getenv(YGGDRASIL_ENV_CAPTURE);
+  const char *replay = g_getenv(YGGDRASIL_ENV_REPLAY);
+  const char *speed = g_getenv(YGGDRASIL_ENV_REPLAY_SPEED);
+
+  if (speed)
+    replay_speed = MAX(g_ascii_strtod(speed, NULL), 0.0);
+
+  if (replay) {
+    replay_load(replay);
+  } else if (capture) {
+    capture_file = fopen(capture, "wb");
+    if (capture_file) {
+      fputs(YGGDRASIL_CAPTURE_MAGIC, capture_file);
+      capture_epoch = g_get_monotonic_time();
+      core_debug_info("capturing to %s\n", capture);
+    } else {
+      core_debug_error("can't capture to %s\n", capture);
+    }
+  }
+}
+
+/*
+ * takes the recorded answer to url: the next one recorded for the same
+ * (masked) url, or failing that the next one for its endpoint, so that a
+ * replay tolerates requests that differ from the recording's
+ */
+static YggdrasilCaptureRecord *replay_take(const char *url) {
+  YggdrasilCaptureRecord *record;
+  char *masked = capture_mask_url(url);
+  char *endpoint;
+  GQueue *queue;
+  GList *l;
+
+  endpoint = capture_endpoint(masked);
+  queue = g_hash_table_lookup(replay_records, endpoint);
+  g_free(endpoint);
+  if (!queue || g_queue_is_empty(queue)) {
+    g_free(masked);
+    return NULL;
+  }
+
+  for (l = queue->head; l; l = l->next)
+    if (!strcmp(((YggdrasilCaptureRecord *)l->data)->url, masked))
+      break;
+  g_free(masked);
+  if (!l)
+    l = queue->head;
+
+  record = l->data;
+  g_queue_delete_link(queue, l);
+  return record;
+}
+
+static gboolean fetch_replay_cb(gpointer data) {
+  YggdrasilFetch *fetch = (YggdrasilFetch *)data;
+  YggdrasilCaptureRecord *record = fetch->replay;
+  const char *error_message = NULL;
+
+  YGGDRASIL_STAGE_ENTER(YGGDRASIL_STAGE_FETCH);
+  fetch->timer = 0;
+  if (!record) {
+    error_message = "not in the capture";
+  } else if (record->status < 0) {
+    g_strlcpy(fetch->error, record->body, sizeof(fetch->error));
+    error_message = fetch->error;
+  } else if (record->status >= 400) {
+    g_snprintf(fetch->error, sizeof(fetch->error), "HTTP error %ld",
+               record->status);
+    error_message = fetch->error;
+  }
+
+  fetch->callback(fetch, fetch->userdata,
+                  error_message ? NULL : record->body,
+                  error_message ? 0 : record->len,
+                  error_message);
+  fetch_free(fetch);
+  YGGDRASIL_STAGE_LEAVE(YGGDRASIL_STAGE_FETCH);
+  return FALSE;
+}
+
+/* answers a fetch from the capture, after the recorded time it took */
+static void fetch_replay(YggdrasilFetch *fetch) {
+  guint delay = 0;
+
+  fetch->replay = replay_take(fetch->url);
+  if (fetch->replay && replay_speed > 0)
+    delay = fetch->replay->duration / replay_speed;
+  fetch->timer = core_ops->timeout_add(delay, fetch_replay_cb, fetch);
+}
+
+/* sets up the multi and share handles and reads the tls settings from the
+ * environment, before the first fetch */
+static void fetch_init(void) {
+  const char *ca_file = g_getenv(YGGDRASIL_ENV_CA_FILE);
+  const char *resolve = g_getenv(YGGDRASIL_ENV_RESOLVE);
+
+  fetch_multi = curl_multi_init();
+  curl_multi_setopt(fetch_multi, CURLMOPT_SOCKETFUNCTION, fetch_socket_fn);
+  curl_multi_setopt(fetch_multi, CURLMOPT_TIMERFUNCTION, fetch_timer_fn);
+
+  fetch_share = curl_share_init();
+  curl_share_setopt(fetch_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  curl_share_setopt(fetch_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+
+  if (ca_file && *ca_file) {
+    fetch_ca_file = g_strdup(ca_file);
+    core_debug_info("trusting the certificates in %s\n", ca_file);
+  }
+  if (resolve && *resolve) {
+    char **entries = g_strsplit(resolve, ",", -1);
+    char **entry;
+
+    for (entry = entries; *entry; entry++)
+      if (**entry)
+        fetch_resolve = curl_slist_append(fetch_resolve, *entry);
+    g_strfreev(entries);
+    core_debug_info("resolving %s\n", resolve);
+  }
+
+  capture_init();
+}
+
+static YggdrasilFetch *fetch_start(const char *url,
+                                   const YggdrasilFetchPolicy *policy,
+                                   YggdrasilFetchCallback callback,
+                                   gpointer userdata, gboolean prewarm) {
+  YggdrasilFetch *fetch;
+
+  if (!fetch_multi)
+    fetch_init();
+
+  fetch = g_new0(YggdrasilFetch, 1);
+  fetch->body = g_string_sized_new(1024);
+  fetch->callback = callback;
+  fetch->userdata = userdata;
+  fetch->policy = policy;
+  fetch->breaker = breaker_get(url);
+  fetch->url = g_strdup(url);
+  fetch->prewarm = prewarm;
+  fetch->started = g_get_monotonic_time();
+
+  if (replay_records) {
+    fetch_replay(fetch);
+    return fetch;
+  }
+
+  fetch->easy = curl_easy_init();
+
+  curl_easy_setopt(fetch->easy, CURLOPT_URL, url);
+  curl_easy_setopt(fetch->easy, CURLOPT_WRITEFUNCTION, fetch_write_fn);
+  curl_easy_setopt(fetch->easy, CURLOPT_WRITEDATA, fetch);
+  curl_easy_setopt(fetch->easy, CURLOPT_PRIVATE, fetch);
+  curl_easy_setopt(fetch->easy, CURLOPT_ERRORBUFFER, fetch->error);
+  curl_easy_setopt(fetch->easy, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(fetch->easy, CURLOPT_CONNECTTIMEOUT_MS,
+                   policy->connect_timeout * 1000L);
+  curl_easy_setopt(fetch->easy, CURLOPT_TIMEOUT_MS, policy->timeout * 1000L);
+  curl_easy_setopt(fetch->easy, CURLOPT_USERAGENT, core_ops->user_agent);
+  curl_easy_setopt(fetch->easy, CURLOPT_SHARE, fetch_share);
+  curl_easy_setopt(fetch->easy, CURLOPT_TCP_KEEPALIVE, 1L);
+  if (fetch_ca_file)
+    curl_easy_setopt(fetch->easy, CURLOPT_CAINFO, fetch_ca_file);
+  if (fetch_resolve)
+    curl_easy_setopt(fetch->easy, CURLOPT_RESOLVE, fetch_resolve);
+  if (prewarm)
+    curl_easy_setopt(fetch->easy, CURLOPT_NOBODY, 1L);
+
+  switch (fetch->breaker->state) {
+  case YGGDRASIL_BREAKER_OPEN:
+    if (g_get_monotonic_time() >= fetch->breaker->retry_at) {
+      fetch->breaker->state = YGGDRASIL_BREAKER_HALF_OPEN;
+      fetch->probe = TRUE;
+      break;
+    }
+    /* fall through */
+  case YGGDRASIL_BREAKER_HALF_OPEN:
+    fetch->timer = core_ops->timeout_add(0, fetch_refused_cb, fetch);
+    return fetch;
+  case YGGDRASIL_BREAKER_CLOSED:
+    break;
+  }
+
+  fetch_attempt(fetch);
+  return fetch;
+}
+
+/*
+ * starts an http GET of url under the given policy. returns a handle that
+ * can be passed to yggdrasil_fetch_cancel until the callback has run. if
+ * the endpoint's breaker is open, the callback fails from the event loop
+ * without touching the network.
+ */
+YggdrasilFetch *yggdrasil_fetch(const char *url,
+                                const YggdrasilFetchPolicy *policy,
+                                YggdrasilFetchCallback callback,
+                                gpointer userdata) {
+  return fetch_start(url, policy, callback, userdata, FALSE);
+}
+
+static void fetch_prewarm_cb(YggdrasilFetch *fetch, gpointer userdata,
+                             const char *body, gsize len,
+                             const char *error_message) {
+  if (error_message)
+    core_debug_info("prewarming %s failed: %s\n", (char *)userdata,
+                    error_message);
+  g_free(userdata);
+}
+
+/*
+ * opens a connection to url's server ahead of the requests that will need
+ * it, with a HEAD request whose answer is thrown away
+ */
+void yggdrasil_fetch_prewarm(const char *url) {
+  if (!fetch_multi)
+    fetch_init();
+  if (replay_records)
+    return;  /* there is no server to warm up */
+  fetch_start(url, &yggdrasil_fetch_policy_poll, fetch_prewarm_cb,
+              g_strdup(url), TRUE);
+}
+
+/* aborts a fetch; its callback will not be called */
+void yggdrasil_fetch_cancel(YggdrasilFetch *fetch) {
+  if (fetch->probe) {
+    /* let the next request probe instead */
+    fetch->breaker->state = YGGDRASIL_BREAKER_OPEN;
+    fetch->breaker->retry_at = 0;
+  }
+  if (fetch->timer)
+    core_ops->timeout_remove(fetch->timer);
+  if (fetch->in_multi)
+    curl_multi_remove_handle(fetch_multi, fetch->easy);
+  fetch_free(fetch);
+}
+
+/*
+ * the poll scheduler
+ */
+static const int poll_intervals[] = {
+  YGGDRASIL_REFRESH_CHAT_INTERVAL,
+  YGGDRASIL_REFRESH_BACKGROUND,
+  YGGDRASIL_REFRESH_AWAY
+};
+
+int yggdrasil_poll_seconds(YggdrasilPollMode mode) {
+  return poll_intervals[mode];
+}
+
+guint yggdrasil_poll_timer_add(YggdrasilPollMode mode, GSourceFunc function,
+                               gpointer data) {
+  if (replay_records && replay_speed != 1.0)
+    /* a replay polls as much faster as it answers */
+    return core_ops->timeout_add(
+      replay_speed > 0 ?
+        MAX(poll_intervals[mode] * 1000 / replay_speed,
+            YGGDRASIL_REPLAY_POLL_MIN) :
+        YGGDRASIL_REPLAY_POLL_MIN,
+      function, data);
+  return core_ops->timeout_add_seconds(poll_intervals[mode], function, data);
+}
+
+/*
+ * a chat line's speaker: its text, markup aside, up to the first ':', with
+ * space trimmed. copies it to speaker (YGGDRASIL_NICK_MAX + 1 bytes) and
+ * points rest past the ':'. returns its length, 0 if the line names no one
+ * or -1 if the name is too long to be a nick.
+ */
+static gssize line_speaker(const char *line, gsize len, char *speaker,
+                           const char **rest) {
+  const char *end = line + len;
+  gsize n = 0, trimmed = 0;
+  gboolean in_tag = FALSE;
+
+  for (; line < end && (in_tag || *line != ':'); line++) {
+    if (*line == '<' && line + 1 < end &&
+        (g_ascii_isalpha(line[1]) || line[1] == '/')) {
+      in_tag = TRUE;
+    } else if (in_tag) {
+      in_tag = *line != '>';
+    } else if (n || !g_ascii_isspace(*line)) {
+      if (n < YGGDRASIL_NICK_MAX)
+        speaker[n] = *line;
+      n++;
+      if (!g_ascii_isspace(*line))
+        trimmed = n;
+    }
+  }
+  if (line == end || trimmed == 0)
+    return 0;
+  if (rest)
+    *rest = line + 1;
+  if (trimmed > YGGDRASIL_NICK_MAX)
+    return -1;
+  speaker[trimmed] = '\0';
+  return trimmed;
+}
+
+/*
+ * the ignore/permit list
+ */
+YggdrasilFilter *yggdrasil_filter_new(gboolean permit) {
+  YggdrasilFilter *filter = g_new0(YggdrasilFilter, 1);
+
+  filter->nicks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                        NULL);
+  filter->permit = permit;
+  return filter;
+}
+
+void yggdrasil_filter_add(YggdrasilFilter *filter, const char *nick) {
+  char *lower = g_ascii_strdown(nick, -1);
+  g_hash_table_replace(filter->nicks, lower, lower);
+}
+
+void yggdrasil_filter_free(YggdrasilFilter *filter) {
+  if (!filter)
+    return;
+  g_hash_table_destroy(filter->nicks);
+  g_free(filter);
+}
+
+/* whether the len bytes at nick, in any case, are let through */
+gboolean yggdrasil_filter_allows(const YggdrasilFilter *filter,
+                                 const char *nick, gsize len) {
+  char lower[YGGDRASIL_NICK_MAX + 1];
+  gsize i;
+
+  if (!filter)
+    return TRUE;
+  /* too long to be a nick, so on no list */
+  if (len > YGGDRASIL_NICK_MAX)
+    return !filter->permit;
+  for (i = 0; i < len; i++)
+    lower[i] = g_ascii_tolower(nick[i]);
+  lower[len] = '\0';
+  return g_hash_table_lookup(filter->nicks, lower) ?
+         filter->permit : !filter->permit;
+}
+
+gboolean yggdrasil_filter_allows_line(const YggdrasilFilter *filter,
+                                      const char *line, gsize len) {
+  char speaker[YGGDRASIL_NICK_MAX + 1];
+  gssize n;
+
+  if (!filter)
+    return TRUE;
+  n = line_speaker(line, len, speaker, NULL);
+  if (n == 0)
+    return TRUE;
+  if (n < 0)
+    return !filter->permit;
+  return yggdrasil_filter_allows(filter, speaker, n);
+}
+
+/*
+ * parsers for chatread.php. everything they return is allocated from the
+ * caller's arena.
+ */
+
+/* copies the len bytes at p to line as a chat line shows them: trailing
+ * space trimmed, <br>s dropped and &nbsp;s made spaces */
+static void chat_line_copy(char *line, const char *p, gsize len) {
+  char *q = line;
+  const char *end = p + len;
+
+  while (end > p && g_ascii_isspace(end[-1]))
+    end--;
+
+  while (p < end) {
+    if (end - p >= 4 && !strncmp(p, "<br>", 4)) {
+      p += 4;
+    } else if (end - p >= 6 && !strncmp(p, "&nbsp;", 6)) {
+      *q++ = ' ';
+      p += 6;
+    } else {
+      *q++ = *p++;
+    }
+  }
+  *q = '\0';
+}
+
+/*
+ * the len bytes at p as a reader sees them: markup dropped, entities
+ * unescaped and space trimmed. a message as it was sent and the station's
+ * copy of it are compared this way, whichever of them is escaped.
+ */
+static char *chat_text_plain(const char *p, gsize len) {
+  static const struct {
+    const char *entity;
+    const char *text;
+  } entities[] = {
+    { "&amp;", "&" }, { "&lt;", "<" }, { "&gt;", ">" }, { "&quot;", "\"" },
+    { "&apos;", "'" }, { "&nbsp;", " " }
+  };
+  const char *end = p + len;
+  GString *text = g_string_sized_new(len);
+  gboolean in_tag = FALSE;
+  guint i;
+
+  while (p < end) {
+    if (in_tag) {
+      in_tag = *p++ != '>';
+      continue;
+    }
+    if (*p == '<' && p + 1 < end && (g_ascii_isalpha(p[1]) || p[1] == '/')) {
+      in_tag = TRUE;
+      p++;
+      continue;
+    }
+    if (*p == '&') {
+      const char *semi = memchr(p, ';', MIN(end - p, 10));
+
+      for (i = 0; i < G_N_ELEMENTS(entities); i++)
+        if (semi && (gsize)(semi + 1 - p) == strlen(entities[i].entity) &&
+            !strncmp(p, entities[i].entity, semi + 1 - p))
+          break;
+      if (i < G_N_ELEMENTS(entities)) {
+        g_string_append(text, entities[i].text);
+        p = semi + 1;
+        continue;
+      }
+      if (semi && p[1] == '#' && semi > p + 2) {
+        gunichar c = strtoul(p + 2, NULL, 10);
+        if (c && g_unichar_validate(c)) {
+          g_string_append_unichar(text, c);
+          p = semi + 1;
+          continue;
+        }
+      }
+    }
+    g_string_append_c(text, *p++);
+  }
+
+  g_strstrip(text->str);
+  text->len = strlen(text->str);
+  return g_string_free(text, FALSE);
+}
+
+static char *parse_chat_line(YggdrasilArena *arena, const char *p, gsize len) {
+  char *line = yggdrasil_arena_alloc(arena, len + 1);
+  chat_line_copy(line, p, len);
+  return line;
+}
+
+/* fills window with the chat lines of body (all but its first and last)
+ * that filter allows */
+void yggdrasil_parse_chat_window(YggdrasilArena *arena, const char *body,
+                                 const YggdrasilFilter *filter,
+                                 GPtrArray *window) {
+  gsize len = strlen(body);
+  const char *first, *last, *p;
+
+  g_ptr_array_set_size(window, 0);
+
+  /* a trailing newline doesn't start another line */
+  if (len > 0 && body[len - 1] == '\n')
+    len--;
+  first = memchr(body, '\n', len);
+  last = g_strrstr_len(body, len, "\n");
+  if (!first || first == last)
+    return;
+
+  for (p = first + 1; p <= last; ) {
+    const char *eol = memchr(p, '\n', last + 1 - p);
+    char *line;
+
+    if (yggdrasil_filter_allows_line(filter, p, eol - p)) {
+      line = parse_chat_line(arena, p, eol - p);
+      if (*line)
+        g_ptr_array_add(window, line);
+    }
+    p = eol + 1;
+  }
+}
+
+/* returns the nth '|'-separated field of the status line, or NULL */
+char *yggdrasil_parse_status_field(YggdrasilArena *arena, const char *body,
+                                   int field) {
+  const char *end = strchr(body, '\n');
+  const char *p = body;
+  const char *bar;
+
+  if (!end)
+    end = body + strlen(body);
+
+  for (; field > 0; field--) {
+    bar = memchr(p, '|', end - p);
+    if (!bar)
+      return NULL;
+    p = bar + 1;
+  }
+
+  bar = memchr(p, '|', end - p);
+  if (bar)
+    end = bar;
+  while (end > p && g_ascii_isspace(end[-1]))
+    end--;
+  return yggdrasil_arena_strndup(arena, p, end - p);
+}
+
+/* the user list is a run of <span title="where">who</span>, listed
+ * as "who @ where", less those filter doesn't allow */
+void yggdrasil_parse_users(YggdrasilArena *arena, const char *body,
+                           const YggdrasilFilter *filter, GPtrArray *users) {
+  const char *p = yggdrasil_parse_status_field(arena, body, 3);
+
+  g_ptr_array_set_size(users, 0);
+
+  while (p && (p = strstr(p, "<span"))) {
+    const char *tag_end = strchr(p, '>');
+    const char *close;
+    const char *title;
+    gsize name_len;
+    char *user;
+
+    if (!tag_end || !(close = strstr(tag_end, "</span>")))
+      break;
+
+    name_len = close - tag_end - 1;
+    if (!yggdrasil_filter_allows(filter, tag_end + 1, name_len)) {
+      p = close + strlen("</span>");
+      continue;
+    }
+    user = yggdrasil_arena_strndup(arena, tag_end + 1, name_len);
+    title = g_strstr_len(p, tag_end - p, "title=\"");
+    if (title) {
+      const char *title_end;
+      title += strlen("title=\"");
+      title_end = memchr(title, '"', tag_end - title);
+      if (title_end) {
+        gsize where_len = title_end - title;
+        user = yggdrasil_arena_alloc(arena, name_len + 3 + where_len + 1);
+        memcpy(user, tag_end + 1, name_len);
+        memcpy(user + name_len, " @ ", 3);
+        memcpy(user + name_len + 3, title, where_len);
+        user[name_len + 3 + where_len] = '\0';
+      }
+    }
+    g_ptr_array_add(users, user);
+    p = close + strlen("</span>");
+  }
+}
+
+/*
+ * login.php answers with "AUTH_CHAT|AUTH_SEARCH|AUTH_SEARCH_SUBDOMAIN".
+ * returns FALSE, leaving the outputs alone, unless all three are present.
+ */
+gboolean yggdrasil_parse_auth(const char *body, char **chat, char **search,
+                              char **subdomain) {
+  gchar **fields = g_strsplit(body, "|", -1);
+  const char *auth[3] = { NULL, NULL, NULL };
+  int found = 0;
+  int i;
+
+  for (i = 0; fields[i] && found < 3; i++) {
+    g_strstrip(fields[i]);
+    if (*fields[i])
+      auth[found++] = fields[i];
+  }
+
+  if (found == 3) {
+    *chat = g_strdup(auth[0]);
+    *search = g_strdup(auth[1]);
+    *subdomain = g_strdup(auth[2]);
+  }
+
+  g_strfreev(fields);
+  return found == 3;
+}
+
+GPtrArray *yggdrasil_parse_tracks(const char *body) {
+  GPtrArray *rows = g_ptr_array_new_with_free_func((GDestroyNotify)g_strfreev);
+  char **lines = g_strsplit(body, "\n", -1);
+  int i, j;
+
+  for (i = 0; lines[i]; i++) {
+    char **fields = g_strsplit(lines[i], "|", 4);
+
+    if (g_strv_length(fields) < 2) {
+      g_strfreev(fields);
+      continue;
+    }
+    for (j = 0; fields[j]; j++)
+      g_strstrip(fields[j]);
+    g_ptr_array_add(rows, fields);
+  }
+
+  g_strfreev(lines);
+  return rows;
+}
+
+GPtrArray *yggdrasil_parse_profile(const char *body) {
+  GPtrArray *fields = g_ptr_array_new_with_free_func((GDestroyNotify)g_strfreev);
+  char **lines = g_strsplit(body, "\n", -1);
+  int i;
+
+  for (i = 0; lines[i]; i++) {
+    char **pair = g_strsplit(lines[i], ":", 2);
+
+    if (g_strv_length(pair) == 2 && *g_strstrip(pair[0])) {
+      g_strstrip(pair[1]);
+      g_ptr_array_add(fields, pair);
+    } else {
+      g_strfreev(pair);
+    }
+  }
+
+  g_strfreev(lines);
+  return fields;
+}
+
+/*
+ * now playing
+ */
+#define NOW_PLAYING_PREFIX "now playing:"
+
+/* the len bytes at p, stripped, or NULL if that leaves nothing */
+static char *now_playing_field(const char *p, gsize len) {
+  char *field = g_strstrip(g_strndup(p, len));
+
+  if (!*field) {
+    g_free(field);
+    return NULL;
+  }
+  return field;
+}
+
+YggdrasilNowPlaying *yggdrasil_parse_now_playing(const char *topic) {
+  YggdrasilNowPlaying *np;
+  char *text = g_malloc(strlen(topic) + 1);
+  char *q = text;
+  const char *p, *sep, *dash, *colon;
+  gsize sep_len = 3;
+  gboolean in_tag = FALSE;
+
+  /* markup dropped, &nbsp;s made spaces and &amp;s ampersands */
+  for (p = topic; *p; p++) {
+    if (*p == '<') {
+      in_tag = TRUE;
+    } else if (in_tag) {
+      if (*p == '>')
+        in_tag = FALSE;
+    } else if (!strncmp(p, "&nbsp;", 6)) {
+      *q++ = ' ';
+      p += 5;
+    } else if (!strncmp(p, "&amp;", 5)) {
+      *q++ = '&';
+      p += 4;
+    } else {
+      *q++ = *p;
+    }
+  }
+  *q = '\0';
+
+  p = g_strstrip(text);
+  if (!g_ascii_strncasecmp(p, NOW_PLAYING_PREFIX,
+                           strlen(NOW_PLAYING_PREFIX))) {
+    p += strlen(NOW_PLAYING_PREFIX);
+    while (g_ascii_isspace(*p))
+      p++;
+  }
+  if (!*p) {
+    g_free(text);
+    return NULL;
+  }
+
+  /* artist and title are split by a hyphen or an en dash */
+  sep = strstr(p, " - ");
+  dash = strstr(p, " \xe2\x80\x93 ");
+  if (dash && (!sep || dash < sep)) {
+    sep = dash;
+    sep_len = 5;
+  }
+
+  np = g_new0(YggdrasilNowPlaying, 1);
+  np->started = time(NULL);
+  colon = strstr(p, ": ");
+  if (colon && (!sep || colon < sep)) {
+    np->show = now_playing_field(p, colon - p);
+    p = colon + 2;
+  }
+  if (sep) {
+    np->artist = now_playing_field(p, sep - p);
+    np->title = now_playing_field(sep + sep_len, strlen(sep + sep_len));
+  } else {
+    np->title = now_playing_field(p, strlen(p));
+  }
+  if (!np->title) {
+    np->title = np->artist ? np->artist : g_strdup(p);
+    np->artist = NULL;
+  }
+
+  g_free(text);
+  return np;
+}
+
+static gboolean now_playing_field_same(const char *a, const char *b) {
+  if (!a || !b)
+    return a == b;
+  return !g_ascii_strcasecmp(a, b);
+}
+
+gboolean yggdrasil_now_playing_same(const YggdrasilNowPlaying *a,
+                                    const YggdrasilNowPlaying *b) {
+  return now_playing_field_same(a->artist, b->artist) &&
+         now_playing_field_same(a->title, b->title);
+}
+
+/* "artist - title (show)", leaving out what's missing */
+char *yggdrasil_now_playing_describe(const YggdrasilNowPlaying *np) {
+  GString *s = g_string_new(NULL);
+
+  if (np->artist)
+    g_string_append_printf(s, "%s - ", np->artist);
+  g_string_append(s, np->title);
+  if (np->show)
+    g_string_append_printf(s, " (%s)", np->show);
+  return g_string_free(s, FALSE);
+}
+
+void yggdrasil_now_playing_free(gpointer data) {
+  YggdrasilNowPlaying *np = (YggdrasilNowPlaying *)data;
+
+  if (!np)
+    return;
+  g_free(np->artist);
+  g_free(np->title);
+  g_free(np->show);
+  g_free(np);
+}
+
+/*
+ * the diff engine
+ */
+void yggdrasil_line_free(gpointer data) {
+  YggdrasilLine *line = (YggdrasilLine *)data;
+  g_free(line->text);
+  g_free(line);
+}
+
+void yggdrasil_history_append(GQueue *history, const char *text,
+                              time_t mtime) {
+  YggdrasilLine *line = g_new0(YggdrasilLine, 1);
+  line->mtime = mtime;
+  line->text = g_strdup(text);
+  line->hash = g_str_hash(text);
+  g_queue_push_tail(history, line);
+
+  while (g_queue_get_length(history) > YGGDRASIL_HISTORY_MAX)
+    yggdrasil_line_free(g_queue_pop_head(history));
+}
+
+/* the chat window, with its lines' hashes and, for each, the window index of
+ * the line before it with the same hash (or -1) */
+typedef struct {
+  GPtrArray *lines;
+  guint *hashes;
+  gint *same;
+  GHashTable *last;              /* line hash -> 1 + last index in window */
+} YggdrasilWindow;
+
+/* whether line is the window's ith line */
+static gboolean window_line_is(const YggdrasilWindow *window, gint i,
+                               const YggdrasilLine *line) {
+  return line->hash == window->hashes[i] &&
+         !strcmp(line->text, g_ptr_array_index(window->lines, i));
+}
+
+/* index in the window of its last line like line at or before bound, or -1 */
+static gint window_find(const YggdrasilWindow *window,
+                        const YggdrasilLine *line, gint bound) {
+  gpointer found = g_hash_table_lookup(window->last,
+                                       GUINT_TO_POINTER(line->hash));
+  gint i;
+
+  for (i = GPOINTER_TO_INT(found) - 1; i >= 0; i = window->same[i])
+    if (i <= bound && window_line_is(window, i, line))
+      return i;
+  return -1;
+}
+
+static void history_retract(GQueue *history, GList *link, GList **retracted) {
+  g_queue_unlink(history, link);
+  if (retracted) {
+    *retracted = g_list_concat(link, *retracted);
+  } else {
+    yggdrasil_line_free(link->data);
+    g_list_free_1(link);
+  }
+}
+
+/*
+ * walks the history back from l and the window back from its ith line, the
+ * same line, in step. a history line the window doesn't hold before there
+ * was retracted, and is taken out of the history if take is TRUE; a window
+ * line the history never had is skipped, as are the window lines left over
+ * if the history runs out first. returns the lines the two have in common,
+ * and counts the skipped ones in skipped.
+ */
+static guint window_align(GQueue *history, GList *l,
+                          const YggdrasilWindow *window, gint i, guint lost,
+                          gboolean take, GList **retracted, guint *skipped) {
+  guint common = 1;
+
+  *skipped = 0;
+  for (l = l->prev, i--; l && i >= 0 && lost < YGGDRASIL_RETRACT_MAX; ) {
+    GList *prev = l->prev;
+
+    if (window_line_is(window, i, l->data)) {
+      common++;
+      i--;
+      l = prev;
+    } else if (window_find(window, l->data, i) < 0) {
+      if (take)
+        history_retract(history, l, retracted);
+      lost++;
+      l = prev;
+    } else {
+      (*skipped)++;
+      i--;
+    }
+  }
+  if (!l && i >= 0)
+    *skipped += i + 1;
+  return common;
+}
+
+/*
+ * the server sends a sliding window of the latest lines, out of which /undo
+ * can take lines. returns the index of the first line in the window that
+ * the history doesn't have yet, and takes the history lines the window has
+ * lost out of the history, prepending them to retracted (or freeing them if
+ * it is NULL).
+ *
+ * the history is anchored at the window line where the two, walked back in
+ * step, have the most lines in common and the window the fewest lines the
+ * history never had; a line repeated in the window can't pull the anchor
+ * past the lines after it. only the latest few history lines are tried,
+ * against each copy of them in the window, so this costs a few walks of
+ * the window however long the history.
+ */
+guint yggdrasil_history_delta(GQueue *history, GPtrArray *lines,
+                              GList **retracted) {
+  YggdrasilWindow window;
+  GList *anchor = NULL, *l;
+  guint depth, lost = 0, best = 0, best_skipped = 0, skipped;
+  gint i, at = -1;
+
+  if (!lines->len || g_queue_is_empty(history))
+    return 0;
+
+  window.lines = lines;
+  window.hashes = g_new(guint, lines->len);
+  window.same = g_new(gint, lines->len);
+  window.last = g_hash_table_new(g_direct_hash, g_direct_equal);
+  for (i = 0; i < (gint)lines->len; i++) {
+    gpointer key;
+
+    window.hashes[i] = g_str_hash(g_ptr_array_index(lines, i));
+    key = GUINT_TO_POINTER(window.hashes[i]);
+    window.same[i] = GPOINTER_TO_INT(g_hash_table_lookup(window.last, key)) - 1;
+    g_hash_table_insert(window.last, key, GINT_TO_POINTER(i + 1));
+  }
+
+  /* the history lines after the anchor are all retracted, so it's looked
+   * for among the latest few only, each against every copy in the window */
+  for (l = history->tail, depth = 0;
+       l && depth <= YGGDRASIL_RETRACT_MAX; l = l->prev, depth++) {
+    for (i = window_find(&window, l->data, lines->len - 1); i >= 0;
+         i = window_find(&window, l->data, i - 1)) {
+      guint common = window_align(history, l, &window, i, depth, FALSE, NULL,
+                                  &skipped);
+
+      if (common > best || (common == best && skipped < best_skipped)) {
+        anchor = l;
+        at = i;
+        best = common;
+        best_skipped = skipped;
+      }
+    }
+  }
+
+  /* the window holds every line after the anchor; those it lacks are gone */
+  while (anchor && history->tail != anchor) {
+    history_retract(history, history->tail, retracted);
+    lost++;
+  }
+  if (anchor)
+    window_align(history, anchor, &window, at, lost, TRUE, retracted,
+                 &skipped);
+
+  g_hash_table_destroy(window.last);
+  g_free(window.same);
+  g_free(window.hashes);
+
+  /* with nothing in common, it's all new */
+  return at + 1;
+}
+
+/*
+ * drops the lines filter no longer allows from the history, so that the
+ * next chat window, which won't have them either, doesn't take them for
+ * retracted. returns how many were dropped.
+ */
+guint yggdrasil_history_filter(GQueue *history,
+                               const YggdrasilFilter *filter) {
+  GList *l = history->head;
+  guint dropped = 0;
+
+  while (l) {
+    YggdrasilLine *line = (YggdrasilLine *)l->data;
+    GList *next = l->next;
+
+    if (!yggdrasil_filter_allows_line(filter, line->text,
+                                      strlen(line->text))) {
+      history_retract(history, l, NULL);
+      dropped++;
+    }
+    l = next;
+  }
+  return dropped;
+}
+
+YggdrasilEcho *yggdrasil_echo_new(guint id, const char *nick,
+                                  const char *message) {
+  YggdrasilEcho *echo = g_new0(YggdrasilEcho, 1);
+
+  echo->id = id;
+  echo->nick = g_ascii_strdown(nick, -1);
+  echo->text = chat_text_plain(message, strlen(message));
+  echo->at = g_get_monotonic_time();
+  return echo;
+}
+
+void yggdrasil_echo_free(gpointer data) {
+  YggdrasilEcho *echo = (YggdrasilEcho *)data;
+  g_free(echo->nick);
+  g_free(echo->text);
+  g_free(echo);
+}
+
+/*
+ * a line is an echo's copy when its speaker (see line_speaker) is the
+ * echo's nick, in any case, and all that follows the ':' reads the same as
+ * the echo's text. echoes are matched oldest first, as the station keeps
+ * order.
+ */
+guint yggdrasil_echo_match(GQueue *echoes, const char *line) {
+  gint64 expired = g_get_monotonic_time() -
+                   (gint64)YGGDRASIL_ECHO_TTL * G_USEC_PER_SEC;
+  char speaker[YGGDRASIL_NICK_MAX + 1];
+  YggdrasilEcho *echo;
+  const char *rest;
+  char *text;
+  gssize n;
+  GList *l;
+  guint id = 0;
+
+  while ((echo = g_queue_peek_head(echoes)) && echo->at < expired)
+    yggdrasil_echo_free(g_queue_pop_head(echoes));
+  if (g_queue_is_empty(echoes))
+    return 0;
+
+  n = line_speaker(line, strlen(line), speaker, &rest);
+  if (n <= 0)
+    return 0;
+  text = chat_text_plain(rest, strlen(rest));
+
+  for (l = echoes->head; l; l = l->next) {
+    echo = (YggdrasilEcho *)l->data;
+    if (echo->id && strlen(echo->nick) == (gsize)n &&
+        !g_ascii_strncasecmp(echo->nick, speaker, n) &&
+        !strcmp(echo->text, text)) {
+      id = echo->id;
+      yggdrasil_echo_free(echo);
+      g_queue_delete_link(echoes, l);
+      break;
+    }
+  }
+  g_free(text);
+  return id;
+}
+
+/* drops nick's echoes with ids first to last, whose lines never got sent */
+void yggdrasil_echo_forget(GQueue *echoes, const char *nick, guint first,
+                           guint last) {
+  char *lower = g_ascii_strdown(nick, -1);
+  GList *l = echoes->head;
+
+  while (l) {
+    YggdrasilEcho *echo = (YggdrasilEcho *)l->data;
+    GList *next = l->next;
+
+    if (echo->id >= first && echo->id <= last &&
+        !strcmp(echo->nick, lower)) {
+      yggdrasil_echo_free(echo);
+      g_queue_delete_link(echoes, l);
+    }
+    l = next;
+  }
+  g_free(lower);
+}
+
+/* replaces nick's echoes with ids first to last, sent together as message,
+ * by one echo of message in the place of the first */
+void yggdrasil_echo_merge(GQueue *echoes, const char *nick, guint first,
+                          guint last, const char *message) {
+  char *lower = g_ascii_strdown(nick, -1);
+  GList *l = echoes->head;
+  GList *at = NULL;
+
+  while (l) {
+    YggdrasilEcho *echo = (YggdrasilEcho *)l->data;
+    GList *next = l->next;
+
+    if (echo->id >= first && echo->id <= last &&
+        !strcmp(echo->nick, lower)) {
+      if (!at) {
+        at = l;
+        g_free(echo->text);
+        echo->text = chat_text_plain(message, strlen(message));
+        echo->id = first;
+      } else {
+        yggdrasil_echo_free(echo);
+        g_queue_delete_link(echoes, l);
+      }
+    }
+    l = next;
+  }
+  g_free(lower);
+}
+
+GHashTable *yggdrasil_members_new(void) {
+  return g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                               yggdrasil_nick_unref, NULL);
+}
+
+void yggdrasil_roster_diff(GHashTable *members, GPtrArray *users,
+                           GList **added, GList **removed) {
+  GHashTable *seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+  GList *joined = NULL;
+  GHashTableIter iter;
+  gpointer key;
+  guint i;
+
+  for (i = 0; i < users->len; i++) {
+    YggdrasilNick *nick = yggdrasil_nick_intern(g_ptr_array_index(users, i));
+
+    if (g_hash_table_lookup(seen, nick)) {
+      yggdrasil_nick_unref(nick);
+      continue;
+    }
+    g_hash_table_insert(seen, nick, nick);
+    if (!g_hash_table_lookup(members, nick))
+      joined = g_list_prepend(joined, nick);
+  }
+
+  g_hash_table_iter_init(&iter, members);
+  while (g_hash_table_iter_next(&iter, &key, NULL))
+    if (!g_hash_table_lookup(seen, key))
+      *removed = g_list_prepend(*removed, yggdrasil_nick_ref(key));
+
+  /* seen's references move to members */
+  g_hash_table_remove_all(members);
+  g_hash_table_iter_init(&iter, seen);
+  while (g_hash_table_iter_next(&iter, &key, NULL))
+    g_hash_table_insert(members, key, key);
+  g_hash_table_destroy(seen);
+
+  /* in roster order */
+  while (joined) {
+    *added = g_list_prepend(*added, joined->data);
+    joined = g_list_delete_link(joined, joined);
+  }
+}
+
+/*
+ * the archive and its search index. writing the archive needs pread,
+ * ftruncate and fsync, so on other systems it is never opened: appends are
+ * dropped and queries find nothing.
+ */
+#ifdef G_OS_UNIX
+static gboolean archive_flush_cb(gpointer data);
+
+/* the end of the last complete record in the segment at or after from: just
+ * past its newline, or from if there is none. -1 if it can't be read. */
+static off_t archive_complete_end(int fd, off_t from, off_t size) {
+  char buf[4096];
+  off_t at = size;
+
+  while (at > from) {
+    off_t start = MAX(from, at - (off_t)sizeof(buf));
+    ssize_t n = pread(fd, buf, at - start, start);
+
+    if (n != at - start)
+      return -1;
+    while (n > 0)
+      if (buf[--n] == '\n')
+        return start + n + 1;
+    at = start;
+  }
+  return from;
+}
+
+YggdrasilArchive *yggdrasil_archive_open(const char *path) {
+  YggdrasilArchive *archive = g_new0(YggdrasilArchive, 1);
+  char *dir = g_path_get_dirname(path);
+  struct stat st;
+
+  archive->path = g_strdup(path);
+  archive->index_path = g_strdup_printf("%s.idx", path);
+  archive->last_indexed = -1;
+  archive->pending = g_string_new(NULL);
+  archive->pending_index = g_string_new(NULL);
+
+  g_mkdir_with_parents(dir, 0700);
+  g_free(dir);
+
+  archive->fd = open(archive->path, O_RDWR | O_CREAT | O_APPEND, 0600);
+  archive->index_fd = open(archive->index_path,
+                           O_RDWR | O_CREAT | O_APPEND, 0600);
+  if (archive->fd < 0 || archive->index_fd < 0) {
+    core_debug_error("couldn't open archive %s\n", path);
+    return archive;  /* appends are dropped; queries find nothing */
+  }
+
+  if (fstat(archive->fd, &st) == 0)
+    archive->size = st.st_size;
+
+  /* pick up where the index left off; a torn trailing entry is dropped */
+  if (fstat(archive->index_fd, &st) == 0 &&
+      st.st_size >= (off_t)sizeof(YggdrasilArchiveEntry)) {
+    YggdrasilArchiveEntry last;
+    off_t at = (st.st_size / sizeof(last) - 1) * sizeof(last);
+    if (pread(archive->index_fd, &last, sizeof(last), at) == sizeof(last)) {
+      archive->last_indexed = last.offset;
+      archive->last_mtime = last.mtime;
+    }
+    if (ftruncate(archive->index_fd, at + sizeof(last)) != 0)
+      core_debug_error("couldn't trim %s\n", archive->index_path);
+  }
+
+  /* and so is a torn record at the end of the segment, which appends would
+   * otherwise run on from */
+  if (archive->size > 0) {
+    off_t end = archive_complete_end(archive->fd,
+                                     MAX(archive->last_indexed, 0),
+                                     archive->size);
+    if (end >= 0 && end < archive->size) {
+      if (ftruncate(archive->fd, end) == 0)
+        archive->size = end;
+      else
+        core_debug_error("couldn't trim %s\n", archive->path);
+    }
+  }
+
+  return archive;
+}
+
+/* writes out pending appends, then syncs them to disk if asked to. the
+ * index goes after the segment, so it never points past the data. */
+void yggdrasil_archive_flush(YggdrasilArchive *archive, gboolean sync) {
+  if (archive->fd < 0 || !archive->pending->len)
+    return;
+
+  if (write(archive->fd, archive->pending->str, archive->pending->len) !=
+      (ssize_t)archive->pending->len)
+    core_debug_error("couldn't append to %s\n", archive->path);
+  if (sync)
+    fsync(archive->fd);
+
+  if (archive->pending_index->len &&
+      write(archive->index_fd, archive->pending_index->str,
+            archive->pending_index->len) !=
+        (ssize_t)archive->pending_index->len)
+    core_debug_error("couldn't append to %s\n", archive->index_path);
+  if (sync)
+    fsync(archive->index_fd);
+
+  g_string_truncate(archive->pending, 0);
+  g_string_truncate(archive->pending_index, 0);
+  archive->pending_lines = 0;
+}
+
+/* returns the segment offset the record was appended at */
+gint64 yggdrasil_archive_append(YggdrasilArchive *archive, time_t mtime,
+                                const char *text) {
+  gint64 offset = archive->size;
+  gsize before;
+
+  /* keep the segment in time order, which the index relies on */
+  mtime = MAX(mtime, archive->last_mtime);
+  archive->last_mtime = mtime;
+
+  if (archive->last_indexed < 0 ||
+      archive->size - archive->last_indexed >= YGGDRASIL_ARCHIVE_INDEX_STRIDE) {
+    YggdrasilArchiveEntry entry;
+    entry.mtime = mtime;
+    entry.offset = archive->size;
+    g_string_append_len(archive->pending_index, (const char *)&entry,
+                        sizeof(entry));
+    archive->last_indexed = archive->size;
+  }
+
+  before = archive->pending->len;
+  g_string_append_printf(archive->pending, "%ld\t", (long)mtime);
+  g_string_append(archive->pending, text);
+  g_string_append_c(archive->pending, '\n');
+  archive->size += archive->pending->len - before;
+
+  if (++archive->pending_lines >= YGGDRASIL_ARCHIVE_FLUSH_LINES)
+    yggdrasil_archive_flush(archive, TRUE);
+  else if (!archive->flush_timer)
+    archive->flush_timer = core_ops->timeout_add_seconds(
+      YGGDRASIL_ARCHIVE_FLUSH_INTERVAL, archive_flush_cb, archive);
+
+  return offset;
+}
+
+static gboolean archive_flush_cb(gpointer data) {
+  YggdrasilArchive *archive = (YggdrasilArchive *)data;
+  archive->flush_timer = 0;
+  yggdrasil_archive_flush(archive, TRUE);
+  return FALSE;
+}
+
+void yggdrasil_archive_close(YggdrasilArchive *archive) {
+  if (archive->flush_timer)
+    core_ops->timeout_remove(archive->flush_timer);
+  yggdrasil_archive_flush(archive, TRUE);
+  if (archive->fd >= 0)
+    close(archive->fd);
+  if (archive->index_fd >= 0)
+    close(archive->index_fd);
+  g_string_free(archive->pending, TRUE);
+  g_string_free(archive->pending_index, TRUE);
+  g_free(archive->path);
+  g_free(archive->index_path);
+  g_free(archive);
+}
+#else
+YggdrasilArchive *yggdrasil_archive_open(const char *path) {
+  YggdrasilArchive *archive = g_new0(YggdrasilArchive, 1);
+
+  archive->path = g_strdup(path);
+  archive->index_path = g_strdup_printf("%s.idx", path);
+  archive->fd = archive->index_fd = -1;
+  core_debug_error("the archive isn't supported here; %s not kept\n", path);
+  return archive;
+}
+
+void yggdrasil_archive_flush(YggdrasilArchive *archive, gboolean sync) {
+}
+
+gint64 yggdrasil_archive_append(YggdrasilArchive *archive, time_t mtime,
+                                const char *text) {
+  return archive->size;
+}
+
+void yggdrasil_archive_close(YggdrasilArchive *archive) {
+  g_free(archive->path);
+  g_free(archive->index_path);
+  g_free(archive);
+}
+#endif
+
+/* parses the record at p; returns the start of the next one, or NULL at
+ * the end of the segment or a torn record */
+static const char *archive_record(const char *p, const char *end,
+                                  time_t *mtime, const char **text,
+                                  gsize *len) {
+  const char *eol = memchr(p, '\n', end - p);
+  const char *tab = eol ? memchr(p, '\t', eol - p) : NULL;
+
+  if (!tab)
+    return NULL;
+
+  *mtime = g_ascii_strtoll(p, NULL, 10);
+  *text = tab + 1;
+  *len = eol - tab - 1;
+  return eol + 1;
+}
+
+/* calls func on the records at the given segment offsets, in order */
+void yggdrasil_archive_read_at(YggdrasilArchive *archive, const gint64 *offsets,
+                               guint n, YggdrasilArchiveFunc func,
+                               gpointer userdata) {
+  GMappedFile *segment;
+  const char *base, *end;
+  guint i;
+
+  yggdrasil_archive_flush(archive, FALSE);
+  segment = g_mapped_file_new(archive->path, FALSE, NULL);
+  if (!segment)
+    return;
+
+  base = g_mapped_file_get_contents(segment);
+  end = base + g_mapped_file_get_length(segment);
+  for (i = 0; i < n; i++) {
+    const char *text;
+    time_t mtime;
+    gsize len;
+
+    if (offsets[i] < end - base &&
+        archive_record(base + offsets[i], end, &mtime, &text, &len)) {
+      char *line = g_strndup(text, len);
+      func(mtime, line, userdata);
+      g_free(line);
+    }
+  }
+
+  g_mapped_file_unref(segment);
+}
+
+/*
+ * calls func on up to max records with from <= mtime < to, oldest first.
+ * returns how many it found.
+ */
+int yggdrasil_archive_query(YggdrasilArchive *archive, time_t from, time_t to,
+                            int max, YggdrasilArchiveFunc func,
+                            gpointer userdata) {
+  GMappedFile *index, *segment;
+  const char *p, *end;
+  gint64 start = 0;
+  int found = 0;
+
+  if (archive->fd < 0)
+    return 0;
+  yggdrasil_archive_flush(archive, FALSE);
+
+  /* the last index entry before from is where the scan starts */
+  index = g_mapped_file_new(archive->index_path, FALSE, NULL);
+  if (index) {
+    const YggdrasilArchiveEntry *entries =
+      (const YggdrasilArchiveEntry *)g_mapped_file_get_contents(index);
+    gsize lo = 0, hi = g_mapped_file_get_length(index) / sizeof(*entries);
+
+    while (lo < hi) {
+      gsize mid = lo + (hi - lo) / 2;
+      if (entries[mid].mtime < from)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo > 0)
+      start = entries[lo - 1].offset;
+    g_mapped_file_unref(index);
+  }
+
+  segment = g_mapped_file_new(archive->path, FALSE, NULL);
+  if (!segment)
+    return 0;
+
+  p = g_mapped_file_get_contents(segment);
+  end = p + g_mapped_file_get_length(segment);
+  p += MIN(start, end - p);
+
+  while (p && p < end && found < max) {
+    const char *text;
+    const char *next;
+    time_t mtime;
+    gsize len;
+
+    next = archive_record(p, end, &mtime, &text, &len);
+    if (!next || mtime >= to)
+      break;
+    if (mtime >= from) {
+      char *line = g_strndup(text, len);
+      func(mtime, line, userdata);
+      g_free(line);
+      found++;
+    }
+    p = next;
+  }
+
+  g_mapped_file_unref(segment);
+  return found;
+}
+
+typedef void (*YggdrasilTokenFunc)(const char *token, gpointer userdata);
+
+/*
+ * splits text into lowercased runs of letters and digits. markup tags and
+ * entities separate tokens; bytes of multibyte characters are kept as is.
+ */
+static void tokenize(const char *text, gsize len, YggdrasilTokenFunc func,
+                     gpointer userdata) {
+  const char *p = text, *end = text + len;
+  char token[256];
+  gsize n = 0;
+
+  for (; p <= end; p++) {
+    guchar c = p < end ? *p : ' ';
+
+    if (c == '<' || c == '&') {
+      const char *close = memchr(p, c == '<' ? '>' : ';', end - p);
+      if (close && (c == '<' || close - p <= 8)) {
+        p = close;
+        c = ' ';
+      }
+    }
+
+    if (g_ascii_isalnum(c) || c >= 0x80) {
+      if (n < sizeof(token) - 1)
+        token[n++] = g_ascii_tolower(c);
+    } else if (n) {
+      token[n] = '\0';
+      func(token, userdata);
+      n = 0;
+    }
+  }
+}
+
+typedef struct {
+  YggdrasilSearchIndex *index;
+  gint64 offset;
+} YggdrasilIndexAdd;
+
+static void index_add_token(const char *token, gpointer userdata) {
+  YggdrasilIndexAdd *add = (YggdrasilIndexAdd *)userdata;
+  GArray *postings = g_hash_table_lookup(add->index->postings, token);
+
+  if (!postings) {
+    postings = g_array_new(FALSE, FALSE, sizeof(gint64));
+    g_hash_table_insert(add->index->postings, g_strdup(token), postings);
+  }
+  /* a token repeated within the record is posted once */
+  if (!postings->len ||
+      g_array_index(postings, gint64, postings->len - 1) != add->offset)
+    g_array_append_val(postings, add->offset);
+}
+
+void yggdrasil_index_add(YggdrasilSearchIndex *index, gint64 offset,
+                         const char *text, gsize len) {
+  YggdrasilIndexAdd add = { index, offset };
+  tokenize(text, len, index_add_token, &add);
+}
+
+static void postings_free(gpointer data) {
+  g_array_free((GArray *)data, TRUE);
+}
+
+YggdrasilSearchIndex *yggdrasil_index_new(void) {
+  YggdrasilSearchIndex *index = g_new0(YggdrasilSearchIndex, 1);
+  index->postings = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                          g_free, postings_free);
+  return index;
+}
+
+void yggdrasil_index_free(YggdrasilSearchIndex *index) {
+  if (index->build_timer)
+    core_ops->timeout_remove(index->build_timer);
+  if (index->segment)
+    g_mapped_file_unref(index->segment);
+  g_hash_table_destroy(index->postings);
+  g_free(index);
+}
+
+gboolean yggdrasil_index_built(YggdrasilSearchIndex *index) {
+  return index->built;
+}
+
+/* indexes the next few archived lines; once it runs out, catches up with
+ * what was archived since it started, and then it's built */
+static gboolean index_build_cb(gpointer data) {
+  YggdrasilSearchIndex *index = (YggdrasilSearchIndex *)data;
+  const char *base = g_mapped_file_get_contents(index->segment);
+  const char *end = base + g_mapped_file_get_length(index->segment);
+  const char *p = base + index->next;
+  int lines;
+
+  for (lines = 0; p && p < end && lines < YGGDRASIL_INDEX_BUILD_LINES;
+       lines++) {
+    const char *text;
+    const char *next;
+    time_t mtime;
+    gsize len;
+
+    next = archive_record(p, end, &mtime, &text, &len);
+    if (next)
+      yggdrasil_index_add(index, p - base, text, len);
+    p = next;
+  }
+  if (p)
+    index->next = p - base;
+  index->records += lines;
+  if (p && p < end)
+    return TRUE;
+
+  yggdrasil_archive_flush(index->archive, FALSE);
+  if (p && index->archive->size > index->next) {
+    g_mapped_file_unref(index->segment);
+    index->segment = g_mapped_file_new(index->archive->path, FALSE, NULL);
+    if (index->segment)
+      return TRUE;
+  }
+
+  if (index->segment)
+    g_mapped_file_unref(index->segment);
+  index->segment = NULL;
+  index->archive = NULL;
+  index->build_timer = 0;
+  index->built = TRUE;
+  core_debug_info("indexed %d archived lines, %u tokens\n", index->records,
+                  g_hash_table_size(index->postings));
+  return FALSE;
+}
+
+/* starts indexing everything archived so far in the background; until
+ * yggdrasil_index_built, searches only see the older lines. archive has to
+ * outlive the build. */
+void yggdrasil_index_build(YggdrasilSearchIndex *index,
+                           YggdrasilArchive *archive) {
+  if (index->built || index->build_timer)
+    return;
+
+  yggdrasil_archive_flush(archive, FALSE);
+  index->segment = g_mapped_file_new(archive->path, FALSE, NULL);
+  if (!index->segment) {
+    index->built = TRUE;
+    return;
+  }
+  index->archive = archive;
+  index->build_timer = core_ops->timeout_add(YGGDRASIL_INDEX_BUILD_INTERVAL,
+                                             index_build_cb, index);
+}
+
+static gint postings_cmp_len(gconstpointer a, gconstpointer b) {
+  return (*(GArray **)a)->len - (*(GArray **)b)->len;
+}
+
+/* keeps the offsets of result that also appear in postings */
+static void postings_intersect(GArray *result, GArray *postings) {
+  const gint64 *p = (const gint64 *)postings->data;
+  guint lo = 0;
+  guint i, kept = 0;
+
+  for (i = 0; i < result->len; i++) {
+    gint64 offset = g_array_index(result, gint64, i);
+    guint hi = postings->len;
+
+    /* both are ascending, so each search starts where the last ended */
+    while (lo < hi) {
+      guint mid = lo + (hi - lo) / 2;
+      if (p[mid] < offset)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo < postings->len && p[lo] == offset)
+      g_array_index(result, gint64, kept++) = offset;
+  }
+  g_array_set_size(result, kept);
+}
+
+typedef struct {
+  YggdrasilSearchIndex *index;
+  GPtrArray *lists;
+  gboolean missing;
+} YggdrasilIndexQuery;
+
+static void index_query_token(const char *token, gpointer userdata) {
+  YggdrasilIndexQuery *query = (YggdrasilIndexQuery *)userdata;
+  GArray *postings = g_hash_table_lookup(query->index->postings, token);
+  guint i;
+
+  if (!postings) {
+    query->missing = TRUE;
+    return;
+  }
+  for (i = 0; i < query->lists->len; i++)
+    if (g_ptr_array_index(query->lists, i) == postings)
+      return;
+  g_ptr_array_add(query->lists, postings);
+}
+
+/*
+ * returns the ascending offsets of the records containing every token of
+ * words. the shortest posting list is intersected with the others.
+ */
+GArray *yggdrasil_index_search(YggdrasilSearchIndex *index, const char *words) {
+  YggdrasilIndexQuery query = { index, g_ptr_array_new(), FALSE };
+  GArray *result = g_array_new(FALSE, FALSE, sizeof(gint64));
+  guint i;
+
+  tokenize(words, strlen(words), index_query_token, &query);
+
+  if (!query.missing && query.lists->len) {
+    GArray *shortest;
+
+    g_ptr_array_sort(query.lists, postings_cmp_len);
+    shortest = g_ptr_array_index(query.lists, 0);
+    g_array_append_vals(result, shortest->data, shortest->len);
+    for (i = 1; i < query.lists->len && result->len; i++)
+      postings_intersect(result, g_ptr_array_index(query.lists, i));
+  }
+
+  g_ptr_array_free(query.lists, TRUE);
+  return result;
+}
+
+/*
+ * metrics and their exporter. the socket speaks just enough http/1.0 for a
+ * Prometheus scrape: whatever the request, the answer is the exposition,
+ * after which the connection is closed.
+ */
+typedef enum {
+  METRIC_COUNTER,
+  METRIC_GAUGE,
+  METRIC_HISTOGRAM
+} YggdrasilMetricType;
+
+static const struct {
+  const char *name;
+  YggdrasilMetricType type;
+  const char *help;
+} metric_info[YGGDRASIL_METRIC_LAST] = {
+  { "yggdrasil_polls_total", METRIC_COUNTER,
+    "chatread.php answers received" },
+  { "yggdrasil_poll_failures_total", METRIC_COUNTER,
+    "chatread.php requests that failed" },
+  { "yggdrasil_poll_bytes_total", METRIC_COUNTER,
+    "Bytes of chatread.php answers" },
+  { "yggdrasil_messages_total", METRIC_COUNTER,
+    "New intercom lines shown" },
+  { "yggdrasil_sends_total", METRIC_COUNTER,
+    "chatwrite.php calls made" },
+  { "yggdrasil_send_failures_total", METRIC_COUNTER,
+    "chatwrite.php calls that failed or were refused" },
+  { "yggdrasil_logins_total", METRIC_COUNTER,
+    "login.php calls made" },
+  { "yggdrasil_login_failures_total", METRIC_COUNTER,
+    "login.php calls that failed or were refused" },
+  { "yggdrasil_roster_size", METRIC_GAUGE,
+    "Listeners in the intercom at the last poll" },
+  { "yggdrasil_poll_seconds", METRIC_HISTOGRAM,
+    "Time from a chatread.php request to its answer" },
+  { "yggdrasil_parse_seconds", METRIC_HISTOGRAM,
+    "Time spent parsing a chatread.php answer" },
+  { "yggdrasil_send_seconds", METRIC_HISTOGRAM,
+    "Time from a chatwrite.php request to its answer" },
+  { "yggdrasil_login_seconds", METRIC_HISTOGRAM,
+    "Time from a login.php request to its answer" }
+};
+
+/* upper bounds of the histogram buckets, in seconds */
+static const double metric_buckets[] = {
+  0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30
+};
+#define METRIC_BUCKETS  G_N_ELEMENTS(metric_buckets)
+
+typedef struct {
+  double value;                  /* of a counter or gauge; a histogram's sum */
+  guint64 count;                 /* observations of a histogram */
+  guint64 buckets[METRIC_BUCKETS];   /* not cumulative */
+} YggdrasilMetricValue;
+
+/* a scrape in progress */
+typedef struct {
+  int fd;
+  guint watch;
+  GString *buf;                  /* the request, then the response */
+  gsize sent;
+} YggdrasilMetricsClient;
+
+gboolean yggdrasil_metrics_enabled = FALSE;
+
+static YggdrasilMetricValue metric_values[YGGDRASIL_METRIC_LAST];
+static char *metrics_path = NULL;
+static int metrics_fd = -1;
+static guint metrics_watch = 0;
+static GSList *metrics_clients = NULL;
+
+void yggdrasil_metric_record(YggdrasilMetric metric, double value) {
+  YggdrasilMetricValue *v = &metric_values[metric];
+  guint i;
+
+  switch (metric_info[metric].type) {
+  case METRIC_COUNTER:
+    v->value += value;
+    break;
+  case METRIC_GAUGE:
+    v->value = value;
+    break;
+  case METRIC_HISTOGRAM:
+    v->value += value;
+    v->count++;
+    for (i = 0; i < METRIC_BUCKETS && value > metric_buckets[i]; i++)
+      ;
+    if (i < METRIC_BUCKETS)
+      v->buckets[i]++;
+    break;
+  }
+}
+
+static void metrics_append_double(GString *out, double value) {
+  char buf[G_ASCII_DTOSTR_BUF_SIZE];
+  g_string_append(out, g_ascii_dtostr(buf, sizeof(buf), value));
+}
+
+/* the Prometheus text exposition of every metric */
+static void metrics_render(GString *out) {
+  char le[G_ASCII_DTOSTR_BUF_SIZE];
+  int m;
+  guint i;
+
+  for (m = 0; m < YGGDRASIL_METRIC_LAST; m++) {
+    const char *name = metric_info[m].name;
+    YggdrasilMetricValue *v = &metric_values[m];
+    guint64 cumulative = 0;
+
+    g_string_append_printf(out, "# HELP %s %s\n# TYPE %s %s\n",
+                           name, metric_info[m].help, name,
+                           metric_info[m].type == METRIC_COUNTER ? "counter" :
+                           metric_info[m].type == METRIC_GAUGE ? "gauge" :
+                           "histogram");
+    if (metric_info[m].type != METRIC_HISTOGRAM) {
+      g_string_append_printf(out, "%s ", name);
+      metrics_append_double(out, v->value);
+      g_string_append_c(out, '\n');
+      continue;
+    }
+
+    for (i = 0; i < METRIC_BUCKETS; i++) {
+      cumulative += v->buckets[i];
+      g_ascii_formatd(le, sizeof(le), "%g", metric_buckets[i]);
+      g_string_append_printf(out, "%s_bucket{le=\"%s\"} %" G_GUINT64_FORMAT
+                             "\n", name, le, cumulative);
+    }
+    g_string_append_printf(out, "%s_bucket{le=\"+Inf\"} %" G_GUINT64_FORMAT
+                           "\n%s_sum ", name, v->count, name);
+    metrics_append_double(out, v->value);
+    g_string_append_printf(out, "\n%s_count %" G_GUINT64_FORMAT "\n",
+                           name, v->count);
+  }
+}
+
+#ifdef G_OS_UNIX
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static void metrics_client_free(YggdrasilMetricsClient *client) {
+  metrics_clients = g_slist_remove(metrics_clients, client);
+  if (client->watch)
+    core_ops->input_remove(client->watch);
+  close(client->fd);
+  g_string_free(client->buf, TRUE);
+  g_free(client);
+}
+
+static void metrics_client_write_cb(gpointer data, gint fd,
+                                    YggdrasilInputCondition cond) {
+  YggdrasilMetricsClient *client = (YggdrasilMetricsClient *)data;
+  ssize_t n = send(fd, client->buf->str + client->sent,
+                   client->buf->len - client->sent, MSG_NOSIGNAL);
+
+  if (n < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if (n > 0)
+    client->sent += n;
+  if (n <= 0 || client->sent == client->buf->len)
+    metrics_client_free(client);
+}
+
+/* reads the request up to its blank line (or the client's EOF) and answers */
+static void metrics_client_read_cb(gpointer data, gint fd,
+                                   YggdrasilInputCondition cond) {
+  YggdrasilMetricsClient *client = (YggdrasilMetricsClient *)data;
+  GString *body;
+  char buf[1024];
+  ssize_t n = read(fd, buf, sizeof(buf));
+
+  if (n < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if (n < 0) {
+    metrics_client_free(client);
+    return;
+  }
+  g_string_append_len(client->buf, buf, n);
+  if (n > 0 && client->buf->len < sizeof(buf) * 8 &&
+      !strstr(client->buf->str, "\r\n\r\n") &&
+      !strstr(client->buf->str, "\n\n"))
+    return;
+
+  body = g_string_sized_new(4096);
+  metrics_render(body);
+  g_string_printf(client->buf,
+                  "HTTP/1.0 200 OK\r\n"
+                  "Content-Type: text/plain; version=0.0.4\r\n"
+                  "Content-Length: %" G_GSIZE_FORMAT "\r\n"
+                  "Connection: close\r\n\r\n", body->len);
+  g_string_append_len(client->buf, body->str, body->len);
+  g_string_free(body, TRUE);
+
+  core_ops->input_remove(client->watch);
+  client->watch = core_ops->input_add(fd, YGGDRASIL_INPUT_WRITE,
+                                      metrics_client_write_cb, client);
+}
+
+static void metrics_accept_cb(gpointer data, gint fd,
+                              YggdrasilInputCondition cond) {
+  YggdrasilMetricsClient *client;
+  int client_fd = accept(fd, NULL, NULL);
+
+  if (client_fd < 0)
+    return;
+  fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+
+  client = g_new0(YggdrasilMetricsClient, 1);
+  client->fd = client_fd;
+  client->buf = g_string_new(NULL);
+  client->watch = core_ops->input_add(client_fd, YGGDRASIL_INPUT_READ,
+                                      metrics_client_read_cb, client);
+  metrics_clients = g_slist_prepend(metrics_clients, client);
+}
+
+/* listens on the unix socket at path, replacing a stale one */
+static gboolean metrics_listen(const char *path) {
+  struct sockaddr_un addr;
+  struct stat st;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    core_debug_error("metrics socket path too long: %s\n", path);
+    return FALSE;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path);
+
+  metrics_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (metrics_fd < 0 ||
+      bind(metrics_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(metrics_fd, 4) < 0) {
+    core_debug_error("can't serve metrics on %s: %s\n", path,
+                     g_strerror(errno));
+    if (metrics_fd >= 0)
+      close(metrics_fd);
+    metrics_fd = -1;
+    return FALSE;
+  }
+  chmod(path, 0600);
+  fcntl(metrics_fd, F_SETFL, fcntl(metrics_fd, F_GETFL) | O_NONBLOCK);
+  metrics_watch = core_ops->input_add(metrics_fd, YGGDRASIL_INPUT_READ,
+                                      metrics_accept_cb, NULL);
+  return TRUE;
+}
+#else
+static gboolean metrics_listen(const char *path) {
+  core_debug_error("metrics need unix sockets; %s not served\n", path);
+  return FALSE;
+}
+#endif
+
+/* reads the metrics setting from the environment at startup */
+static void metrics_init(void) {
+  const char *path = g_getenv(YGGDRASIL_ENV_METRICS);
+
+  if (!path || !*path || !metrics_listen(path))
+    return;
+  metrics_path = g_strdup(path);
+  yggdrasil_metrics_enabled = TRUE;
+  core_debug_info("serving metrics on %s\n", path);
+}
+
+static void metrics_shutdown(void) {
+#ifdef G_OS_UNIX
+  while (metrics_clients)
+    metrics_client_free(metrics_clients->data);
+#endif
+  if (metrics_watch) {
+    core_ops->input_remove(metrics_watch);
+    metrics_watch = 0;
+  }
+  if (metrics_fd >= 0) {
+    close(metrics_fd);
+    metrics_fd = -1;
+    unlink(metrics_path);
+  }
+  g_free(metrics_path);
+  metrics_path = NULL;
+  yggdrasil_metrics_enabled = FALSE;
+  memset(metric_values, 0, sizeof(metric_values));
+}
+
+/*
+ * the stall watchdog. a stack of the stages being timed; the outermost is a
+ * callback from the main loop, and what the stages nested in it took is
+ * added up until it returns.
+ */
+typedef struct {
+  YggdrasilStage stage;
+  gint64 start;
+  gint64 nested;                 /* spent in the stages directly inside */
+} YggdrasilStageFrame;
+
+static const char *stage_names[YGGDRASIL_STAGE_LAST] = {
+  "fetch", "refresh", "login", "join", "send", "parse", "update_convo",
+  "update_users", "update_topic", "get_info"
+};
+
+/* upper bounds of the histogram's buckets, in ms; the last is open */
+static const guint stage_buckets[] = { 1, 4, 16, 64, 256, 1024 };
+
+gboolean yggdrasil_watchdog_enabled = FALSE;
+
+static gint64 watchdog_budget;   /* usec */
+static YggdrasilStageFrame watchdog_stack[YGGDRASIL_WATCHDOG_DEPTH];
+static guint watchdog_depth;
+static gint64 watchdog_spent[YGGDRASIL_STAGE_LAST];
+static guint watchdog_entered[YGGDRASIL_STAGE_LAST];
+static gint64 watchdog_window[YGGDRASIL_WATCHDOG_WINDOW];  /* usec, a ring */
+static guint watchdog_seen;      /* outermost callbacks timed */
+
+void yggdrasil_stage_enter(YggdrasilStage stage) {
+  if (watchdog_depth == 0) {
+    memset(watchdog_spent, 0, sizeof(watchdog_spent));
+    memset(watchdog_entered, 0, sizeof(watchdog_entered));
+  }
+  if (watchdog_depth < YGGDRASIL_WATCHDOG_DEPTH) {
+    YggdrasilStageFrame *frame = &watchdog_stack[watchdog_depth];
+    frame->stage = stage;
+    frame->nested = 0;
+    frame->start = g_get_monotonic_time();
+  }
+  watchdog_depth++;
+}
+
+/* logs an outermost stage that went over the budget */
+static void watchdog_report(const YggdrasilStageFrame *frame, gint64 took) {
+  GString *report = g_string_new(NULL);
+  guint counts[G_N_ELEMENTS(stage_buckets) + 1];
+  guint n = MIN(watchdog_seen, YGGDRASIL_WATCHDOG_WINDOW);
+  guint i, b;
+
+  g_string_printf(report, "stall: %s took %.1f ms (%.1f ms in itself)",
+                  stage_names[frame->stage], took / 1e3,
+                  (took - frame->nested) / 1e3);
+  for (i = 0; i < YGGDRASIL_STAGE_LAST; i++) {
+    if (i == frame->stage || !watchdog_entered[i])
+      continue;
+    g_string_append_printf(report, ", %s %.1f ms", stage_names[i],
+                           watchdog_spent[i] / 1e3);
+    if (watchdog_entered[i] > 1)
+      g_string_append_printf(report, " in %u", watchdog_entered[i]);
+  }
+
+  memset(counts, 0, sizeof(counts));
+  for (i = 0; i < n; i++) {
+    for (b = 0; b < G_N_ELEMENTS(stage_buckets); b++)
+      if (watchdog_window[i] < stage_buckets[b] * (gint64)1000)
+        break;
+    counts[b]++;
+  }
+  g_string_append_printf(report, "; the last %u callbacks:", n);
+  for (b = 0; b < G_N_ELEMENTS(stage_buckets); b++)
+    g_string_append_printf(report, " <%ums %u", stage_buckets[b], counts[b]);
+  g_string_append_printf(report, " more %u", counts[b]);
+
+  core_debug_error("%s\n", report->str);
+  g_string_free(report, TRUE);
+}
+
+void yggdrasil_stage_leave(YggdrasilStage stage) {
+  YggdrasilStageFrame *frame;
+  gint64 took;
+
+  if (watchdog_depth == 0)
+    return;  /* entered before the watchdog started */
+  if (--watchdog_depth >= YGGDRASIL_WATCHDOG_DEPTH)
+    return;
+
+  frame = &watchdog_stack[watchdog_depth];
+  if (frame->stage != stage) {
+    core_debug_error("watchdog: left %s inside %s; resetting\n",
+                     stage_names[stage], stage_names[frame->stage]);
+    watchdog_depth = 0;
+    return;
+  }
+
+  took = g_get_monotonic_time() - frame->start;
+  watchdog_spent[stage] += took;
+  watchdog_entered[stage]++;
+  if (watchdog_depth > 0) {
+    watchdog_stack[watchdog_depth - 1].nested += took;
+    return;
+  }
+
+  watchdog_window[watchdog_seen++ % YGGDRASIL_WATCHDOG_WINDOW] = took;
+  if (took > watchdog_budget)
+    watchdog_report(frame, took);
+}
+
+/* reads the watchdog setting from the environment at startup */
+static void watchdog_init(void) {
+  const char *budget = g_getenv(YGGDRASIL_ENV_WATCHDOG);
+  int ms = budget ? atoi(budget) : 0;
+
+  if (ms <= 0)
+    return;
+  watchdog_budget = (gint64)ms * 1000;
+  watchdog_depth = 0;
+  watchdog_seen = 0;
+  yggdrasil_watchdog_enabled = TRUE;
+  core_debug_info("logging main-loop callbacks over %d ms\n", ms);
+}
+
+/* Converts a hex character to its integer value */
+char from_hex(char ch) {
+  return isdigit(ch) ? ch - '0' : tolower(ch) - 'a' + 10;
+}
+
+/* Converts an integer value to its hex character*/
+char to_hex(char code) {
+  static char hex[] = "0123456789abcdef";
+  return hex[code & 15];
+}
+
+/* Returns a url-encoded version of str */
+/* IMPORTANT: be sure to free() the returned string after use */
+char *url_encode(const char *str) {
+  const char *pstr = str;
+  char *buf = malloc(strlen(str) * 3 + 1), *pbuf = buf;
+  while (*pstr) {
+    if (isalnum(*pstr) || *pstr == '-' || *pstr == '_' || *pstr == '.' || *pstr == '~')
+      *pbuf++ = *pstr;
+    else if (*pstr == ' ')
+      *pbuf++ = '+';
+    else
+      *pbuf++ = '%', *pbuf++ = to_hex(*pstr >> 4), *pbuf++ = to_hex(*pstr & 15);
+    pstr++;
+  }
+  *pbuf = '\0';
+  return buf;
+}
+
+void yggdrasil_core_init(const YggdrasilCoreOps *ops) {
+  core_ops = ops;
+  curl_global_init(CURL_GLOBAL_ALL);
+  metrics_init();
+  watchdog_init();
+}
+
+void yggdrasil_core_shutdown(void) {
+  yggdrasil_watchdog_enabled = FALSE;
+  metrics_shutdown();
+  if (fetch_multi) {
+    curl_multi_cleanup(fetch_multi);
+    fetch_multi = NULL;
+  }
+  if (fetch_share) {
+    curl_share_cleanup(fetch_share);
+    fetch_share = NULL;
+  }
+  curl_slist_free_all(fetch_resolve);
+  fetch_resolve = NULL;
+  g_free(fetch_ca_file);
+  fetch_ca_file = NULL;
+  if (fetch_breakers) {
+    g_hash_table_destroy(fetch_breakers);
+    fetch_breakers = NULL;
+  }
+  if (capture_file) {
+    fclose(capture_file);
+    capture_file = NULL;
+  }
+  if (replay_records) {
+    GHashTableIter iter;
+    gpointer queue;
+
+    g_hash_table_iter_init(&iter, replay_records);
+    while (g_hash_table_iter_next(&iter, NULL, &queue))
+      g_queue_free_full(queue, capture_record_free);
+    g_hash_table_destroy(replay_records);
+    replay_records = NULL;
+  }
+  if (nick_table) {
+    /* every user has released its nicks by now */
+    g_hash_table_destroy(nick_table);
+    nick_table = NULL;
+  }
+  curl_global_cleanup();
+  core_ops = NULL;
+}
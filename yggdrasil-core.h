@@ -0,0 +1,396 @@
+/**
+ * yggdrasil-core
+ *
+ * The protocol side of yggdrasilprpl, free of libpurple: the http client,
+ * the parsers for YggdrasilRadio's answers, the chat diff engine, the poll
+ * scheduler and the archive. The prpl is an adapter over it; anything else
+ * that wants to talk to the station (a benchmark, a bot) can link it too.
+ *
+ * The core doesn't run an event loop of its own. Whoever uses it hands
+ * yggdrasil_core_init a YggdrasilCoreOps with timers and fd watches, the way
+ * a UI hands libpurple its PurpleEventLoopUiOps.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#ifndef YGGDRASIL_CORE_H
+#define YGGDRASIL_CORE_H
+
+#include <time.h>
+
+#include <glib.h>
+
+/* polling rates, in seconds, by how closely the intercom is being watched */
+#define YGGDRASIL_REFRESH_CHAT_INTERVAL   10    /* chat window focused */
+#define YGGDRASIL_REFRESH_BACKGROUND      30    /* chat window unfocused */
+#define YGGDRASIL_REFRESH_AWAY            300   /* account away or idle */
+
+#define YGGDRASIL_URL_HOME   "https://yggdrasilradio.net/"
+#define YGGDRASIL_URL_LOGIN  "https://yggdrasilradio.net/login.php?uid=%s&pwd=%s"
+#define YGGDRASIL_URL_CHATWRITE  "https://yggdrasilradio.net/chatwrite.php?auth=%s&msg=%s"
+#define YGGDRASIL_URL_CHATREAD   "https://yggdrasilradio.net/chatread.php?n=%d"
+#define YGGDRASIL_URL_SEARCH_HOME  "https://%s.yggdrasilradio.net/"
+#define YGGDRASIL_URL_SEARCH  "https://%s.yggdrasilradio.net/search.php?auth=%s&q=%s"
+#define YGGDRASIL_URL_PROFILE    "https://yggdrasilradio.net/profile.php?u=%s"
+#define YGGDRASIL_URL_CHANNELS   "https://yggdrasilradio.net/channels.php"
+
+#define YGGDRASIL_CHATREAD_LINES    15   /* lines asked of chatread.php */
+#define YGGDRASIL_CATCHUP_LINES     50   /* lines asked for on coming back */
+#define YGGDRASIL_HISTORY_MAX       100  /* lines kept in the local history */
+#define YGGDRASIL_NICK_MAX          64   /* bytes; longer isn't a nickname */
+
+/*
+ * the event loop and the rest of the world, as seen by the core
+ */
+typedef enum {
+  YGGDRASIL_INPUT_READ  = 1 << 0,
+  YGGDRASIL_INPUT_WRITE = 1 << 1
+} YggdrasilInputCondition;
+
+typedef void (*YggdrasilInputFunction)(gpointer data, int fd,
+                                       YggdrasilInputCondition cond);
+
+typedef struct {
+  guint (*timeout_add)(guint interval, GSourceFunc function, gpointer data);
+  guint (*timeout_add_seconds)(guint interval, GSourceFunc function,
+                               gpointer data);
+  gboolean (*timeout_remove)(guint handle);
+  guint (*input_add)(int fd, YggdrasilInputCondition cond,
+                     YggdrasilInputFunction func, gpointer data);
+  gboolean (*input_remove)(guint handle);
+
+  /* a line of debug output, newline included */
+  void (*debug)(gboolean error, const char *message);
+  /* an endpoint stopped answering (open) or answers again; may be NULL */
+  void (*breaker_changed)(const char *endpoint, gboolean open, int cooldown);
+
+  const char *user_agent;
+} YggdrasilCoreOps;
+
+/* ops must outlive the core */
+void yggdrasil_core_init(const YggdrasilCoreOps *ops);
+void yggdrasil_core_shutdown(void);
+
+char from_hex(char ch);
+char to_hex(char code);
+char *url_encode(const char *str);
+
+/*
+ * an asynchronous http(s) request, driven by libcurl's multi interface from
+ * the event loop. the callback is called exactly once, unless the fetch is
+ * cancelled first; on failure body is NULL and error_message is set.
+ * connections are kept alive and tls sessions resumed across fetches.
+ */
+typedef struct _YggdrasilFetch YggdrasilFetch;
+
+typedef void (*YggdrasilFetchCallback)(YggdrasilFetch *fetch,
+                                       gpointer userdata,
+                                       const char *body, gsize len,
+                                       const char *error_message);
+
+/* timeouts and retries of a kind of request */
+typedef struct {
+  int connect_timeout;           /* seconds */
+  int timeout;                   /* seconds, for the whole request */
+  int retries;                   /* attempts after the first */
+  gboolean idempotent;           /* may be retried after it was sent */
+} YggdrasilFetchPolicy;
+
+extern const YggdrasilFetchPolicy yggdrasil_fetch_policy_login;
+extern const YggdrasilFetchPolicy yggdrasil_fetch_policy_poll;
+extern const YggdrasilFetchPolicy yggdrasil_fetch_policy_write;
+
+YggdrasilFetch *yggdrasil_fetch(const char *url,
+                                const YggdrasilFetchPolicy *policy,
+                                YggdrasilFetchCallback callback,
+                                gpointer userdata);
+void yggdrasil_fetch_cancel(YggdrasilFetch *fetch);
+/* connects to url's server ahead of the fetches that will need it */
+void yggdrasil_fetch_prewarm(const char *url);
+
+/*
+ * the poll scheduler
+ */
+typedef enum {
+  YGGDRASIL_POLL_ACTIVE = 0,     /* someone is looking at the chat */
+  YGGDRASIL_POLL_BACKGROUND,     /* the chat is open but unfocused */
+  YGGDRASIL_POLL_AWAY            /* the account is away or idle */
+} YggdrasilPollMode;
+
+/* seconds between chatread polls at the given rate */
+int yggdrasil_poll_seconds(YggdrasilPollMode mode);
+/* starts a timer polling at the given rate, sped up along with a replay */
+guint yggdrasil_poll_timer_add(YggdrasilPollMode mode, GSourceFunc function,
+                               gpointer data);
+
+/*
+ * a bump allocator for what a poll's parsers produce. everything allocated
+ * from it lives until yggdrasil_arena_reset, which keeps the standard blocks
+ * for the next poll, so steady polling doesn't touch the heap. zero it to
+ * initialize it.
+ */
+typedef struct {
+  GSList *blocks;                /* in use, the current one first */
+  GSList *spare;                 /* standard blocks kept for reuse */
+  gsize used;                    /* bytes of the current block handed out */
+} YggdrasilArena;
+
+gpointer yggdrasil_arena_alloc(YggdrasilArena *arena, gsize n);
+char *yggdrasil_arena_strndup(YggdrasilArena *arena, const char *str,
+                              gsize len);
+void yggdrasil_arena_reset(YggdrasilArena *arena);
+void yggdrasil_arena_clear(YggdrasilArena *arena);
+
+/*
+ * an interned nickname. every copy of a name in the roster, the profile
+ * cache and the prewarm queue is the same YggdrasilNick, so they compare by
+ * pointer. refcounted; the last yggdrasil_nick_unref drops it from the table.
+ */
+typedef struct {
+  char *name;
+  guint id;                      /* unique for the life of the process */
+  guint refs;
+} YggdrasilNick;
+
+YggdrasilNick *yggdrasil_nick_intern(const char *name);
+YggdrasilNick *yggdrasil_nick_lookup(const char *name);
+YggdrasilNick *yggdrasil_nick_ref(YggdrasilNick *nick);
+void yggdrasil_nick_unref(gpointer nick);
+
+/*
+ * an ignore or permit list of nicknames, from purple's privacy settings.
+ * a permit list lets only its nicks through, an ignore list all but them.
+ * the chatread parsers skip the chat lines and roster entries it doesn't
+ * allow (a NULL filter allows everything). a chat line's speaker is taken
+ * to be its text, markup aside, up to the first ':'; lines without one are
+ * always let through. a name longer than YGGDRASIL_NICK_MAX is on no list.
+ */
+typedef struct {
+  GHashTable *nicks;             /* lowercased */
+  gboolean permit;
+} YggdrasilFilter;
+
+YggdrasilFilter *yggdrasil_filter_new(gboolean permit);
+void yggdrasil_filter_add(YggdrasilFilter *filter, const char *nick);
+void yggdrasil_filter_free(YggdrasilFilter *filter);
+gboolean yggdrasil_filter_allows(const YggdrasilFilter *filter,
+                                 const char *nick, gsize len);
+gboolean yggdrasil_filter_allows_line(const YggdrasilFilter *filter,
+                                      const char *line, gsize len);
+
+/*
+ * parsers. chatread.php?n=15 returns the chat window wrapped in one leading
+ * and one trailing line of markup; n=0 returns a '|'-separated status line
+ * whose 2nd field is the topic and whose 4th is the user list. the chatread
+ * parsers put everything they return in arena.
+ */
+void yggdrasil_parse_chat_window(YggdrasilArena *arena, const char *body,
+                                 const YggdrasilFilter *filter,
+                                 GPtrArray *window);
+char *yggdrasil_parse_status_field(YggdrasilArena *arena, const char *body,
+                                   int field);
+void yggdrasil_parse_users(YggdrasilArena *arena, const char *body,
+                           const YggdrasilFilter *filter, GPtrArray *users);
+gboolean yggdrasil_parse_auth(const char *body, char **chat, char **search,
+                              char **subdomain);
+GPtrArray *yggdrasil_parse_tracks(const char *body);
+GPtrArray *yggdrasil_parse_profile(const char *body);
+
+/*
+ * now playing, read from the topic. the station writes it as
+ * "[show: ]artist - title", possibly marked up and after a "Now playing:";
+ * a topic without the " - " is all title. title is never NULL, artist and
+ * show may be. two tracks are the same if their artist and title are, in
+ * any case.
+ */
+typedef struct {
+  char *artist;
+  char *title;
+  char *show;                    /* the DJ or show */
+  time_t started;                /* when it was parsed */
+} YggdrasilNowPlaying;
+
+YggdrasilNowPlaying *yggdrasil_parse_now_playing(const char *topic);
+gboolean yggdrasil_now_playing_same(const YggdrasilNowPlaying *a,
+                                    const YggdrasilNowPlaying *b);
+char *yggdrasil_now_playing_describe(const YggdrasilNowPlaying *np);
+void yggdrasil_now_playing_free(gpointer np);
+
+/*
+ * the diff engine: a history of the latest lines, oldest first, where a new
+ * chat window goes past it, and which of its lines the window no longer has
+ * (taken back with /undo)
+ */
+typedef struct {
+  time_t mtime;
+  char *text;
+  guint hash;                    /* g_str_hash of text */
+} YggdrasilLine;
+
+void yggdrasil_line_free(gpointer line);
+void yggdrasil_history_append(GQueue *history, const char *text,
+                              time_t mtime);
+guint yggdrasil_history_delta(GQueue *history, GPtrArray *window,
+                              GList **retracted);
+guint yggdrasil_history_filter(GQueue *history,
+                               const YggdrasilFilter *filter);
+
+/*
+ * local echoes of what was said from here, waiting for the station's copy.
+ * yggdrasil_echo_match takes the echo a new chat line is the copy of, if
+ * any, so the line needn't be shown a second time; echoes the station never
+ * repeats expire after a few minutes. messages sent as one are merged into
+ * one echo, with the id of the first.
+ */
+typedef struct {
+  guint id;                      /* the caller's; 0 is never matched */
+  char *nick;                    /* who said it */
+  char *text;                    /* as a reader sees it, unescaped */
+  gint64 at;                     /* monotonic time it was said */
+} YggdrasilEcho;
+
+YggdrasilEcho *yggdrasil_echo_new(guint id, const char *nick,
+                                  const char *message);
+void yggdrasil_echo_free(gpointer echo);
+guint yggdrasil_echo_match(GQueue *echoes, const char *line);
+void yggdrasil_echo_forget(GQueue *echoes, const char *nick, guint first,
+                           guint last);
+void yggdrasil_echo_merge(GQueue *echoes, const char *nick, guint first,
+                          guint last, const char *message);
+
+/*
+ * ... and of the roster. members is a set of YggdrasilNicks holding a
+ * reference each. yggdrasil_roster_diff brings it in line with users, a
+ * parsed roster, prepending the nicks that joined to added (borrowed from
+ * members) and new references to those that left to removed.
+ */
+GHashTable *yggdrasil_members_new(void);
+void yggdrasil_roster_diff(GHashTable *members, GPtrArray *users,
+                           GList **added, GList **removed);
+
+/*
+ * the append-only archive of everything read from the intercom, and the
+ * full-text index over it. the index is built from the event loop a chunk
+ * at a time; once it's built, lines are added to it as they are archived.
+ */
+typedef struct _YggdrasilArchive YggdrasilArchive;
+typedef struct _YggdrasilSearchIndex YggdrasilSearchIndex;
+
+typedef void (*YggdrasilArchiveFunc)(time_t mtime, const char *text,
+                                     gpointer userdata);
+
+YggdrasilArchive *yggdrasil_archive_open(const char *path);
+gint64 yggdrasil_archive_append(YggdrasilArchive *archive, time_t mtime,
+                                const char *text);
+void yggdrasil_archive_flush(YggdrasilArchive *archive, gboolean sync);
+void yggdrasil_archive_close(YggdrasilArchive *archive);
+int yggdrasil_archive_query(YggdrasilArchive *archive, time_t from, time_t to,
+                            int max, YggdrasilArchiveFunc func,
+                            gpointer userdata);
+void yggdrasil_archive_read_at(YggdrasilArchive *archive,
+                               const gint64 *offsets, guint n,
+                               YggdrasilArchiveFunc func, gpointer userdata);
+
+YggdrasilSearchIndex *yggdrasil_index_new(void);
+void yggdrasil_index_free(YggdrasilSearchIndex *index);
+gboolean yggdrasil_index_built(YggdrasilSearchIndex *index);
+void yggdrasil_index_add(YggdrasilSearchIndex *index, gint64 offset,
+                         const char *text, gsize len);
+void yggdrasil_index_build(YggdrasilSearchIndex *index,
+                           YggdrasilArchive *archive);
+GArray *yggdrasil_index_search(YggdrasilSearchIndex *index,
+                               const char *words);
+
+/*
+ * metrics, exported in the Prometheus text format over http on the unix
+ * socket YGGDRASIL_METRICS names, if it is set when the core starts. with it
+ * unset, yggdrasil_metrics_enabled is FALSE and the macros below cost a test.
+ */
+typedef enum {
+  YGGDRASIL_METRIC_POLLS = 0,        /* counters */
+  YGGDRASIL_METRIC_POLL_FAILURES,
+  YGGDRASIL_METRIC_POLL_BYTES,
+  YGGDRASIL_METRIC_MESSAGES,
+  YGGDRASIL_METRIC_SENDS,
+  YGGDRASIL_METRIC_SEND_FAILURES,
+  YGGDRASIL_METRIC_LOGINS,
+  YGGDRASIL_METRIC_LOGIN_FAILURES,
+  YGGDRASIL_METRIC_ROSTER_SIZE,      /* gauges */
+  YGGDRASIL_METRIC_POLL_SECONDS,     /* histograms */
+  YGGDRASIL_METRIC_PARSE_SECONDS,
+  YGGDRASIL_METRIC_SEND_SECONDS,
+  YGGDRASIL_METRIC_LOGIN_SECONDS,
+  YGGDRASIL_METRIC_LAST
+} YggdrasilMetric;
+
+extern gboolean yggdrasil_metrics_enabled;
+
+/* adds to a counter, sets a gauge or observes a histogram's value */
+void yggdrasil_metric_record(YggdrasilMetric metric, double value);
+
+#define YGGDRASIL_METRIC(metric, value) \
+  G_STMT_START { \
+    if (yggdrasil_metrics_enabled) \
+      yggdrasil_metric_record((metric), (value)); \
+  } G_STMT_END
+
+/* a start time for YGGDRASIL_METRIC_SINCE; 0 when metrics are off */
+#define YGGDRASIL_METRIC_NOW() \
+  (yggdrasil_metrics_enabled ? g_get_monotonic_time() : 0)
+
+/* observes the seconds elapsed since start in a histogram */
+#define YGGDRASIL_METRIC_SINCE(metric, start) \
+  YGGDRASIL_METRIC((metric), (g_get_monotonic_time() - (start)) / 1e6)
+
+/*
+ * the stall watchdog, for telling where main-loop time goes. with
+ * YGGDRASIL_WATCHDOG=ms set when the core starts, the stages below are timed
+ * from YGGDRASIL_STAGE_ENTER to the matching YGGDRASIL_STAGE_LEAVE, and an
+ * outermost one that takes longer than ms is logged with the stages nested
+ * in it and a histogram of the latest ones. with it unset, the macros cost
+ * a test.
+ */
+typedef enum {
+  YGGDRASIL_STAGE_FETCH = 0,     /* libcurl and the fetch callbacks */
+  YGGDRASIL_STAGE_REFRESH,       /* the poll timer */
+  YGGDRASIL_STAGE_LOGIN,
+  YGGDRASIL_STAGE_JOIN,
+  YGGDRASIL_STAGE_SEND,
+  YGGDRASIL_STAGE_PARSE,
+  YGGDRASIL_STAGE_UPDATE_CONVO,
+  YGGDRASIL_STAGE_UPDATE_USERS,
+  YGGDRASIL_STAGE_UPDATE_TOPIC,
+  YGGDRASIL_STAGE_GET_INFO,
+  YGGDRASIL_STAGE_LAST
+} YggdrasilStage;
+
+extern gboolean yggdrasil_watchdog_enabled;
+
+void yggdrasil_stage_enter(YggdrasilStage stage);
+void yggdrasil_stage_leave(YggdrasilStage stage);
+
+#define YGGDRASIL_STAGE_ENTER(stage) \
+  G_STMT_START { \
+    if (yggdrasil_watchdog_enabled) \
+      yggdrasil_stage_enter(stage); \
+  } G_STMT_END
+
+#define YGGDRASIL_STAGE_LEAVE(stage) \
+  G_STMT_START { \
+    if (yggdrasil_watchdog_enabled) \
+      yggdrasil_stage_leave(stage); \
+  } G_STMT_END
+
+#endif /* YGGDRASIL_CORE_H */
@@ -0,0 +1,421 @@
+/**
+ * yggdrasil-monitor
+ *
+ * A headless reader of the YggdrasilRadio intercom, for archival and alerting
+ * bots. It logs in like the prpl, polls chatread.php on a GMainLoop through
+ * yggdrasil-core, and writes what changed to stdout, one record per line:
+ *
+ *   <unix time><TAB><kind><TAB><text>
+ *
+ * where kind is one of
+ *   msg    a new line of chat
+ *   undo   a line of chat was taken back
+ *   topic  the topic changed
+ *   track  it names another track, as "artist - title (show)"
+ *   join   someone ("who @ where") appeared in the roster
+ *   part   someone left the roster
+ *   down   an endpoint stopped answering
+ *   up     it answers again
+ * Backslashes, tabs and line breaks in text are escaped as \\, \t, \n and \r.
+ * The first poll reports the whole chat window and roster.
+ *
+ * The password is read from the YGGDRASIL_PASSWORD environment variable.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+
+#include <glib.h>
+#ifdef G_OS_UNIX
+#include <glib-unix.h>
+#endif
+
+#include "yggdrasil-core.h"
+
+#define MONITOR_ENV_PASSWORD  "YGGDRASIL_PASSWORD"
+
+typedef struct {
+  YggdrasilPollMode mode;
+  gboolean verbose;
+
+  GMainLoop *loop;
+  int status;                    /* to exit with */
+  guint poll_timer;
+  YggdrasilFetch *login_fetch;
+  YggdrasilFetch *chat_fetch;
+  YggdrasilFetch *status_fetch;
+  gint64 chat_fetch_at;          /* when they were made, for metrics */
+  gint64 status_fetch_at;
+
+  YggdrasilArena arena;          /* backs the parsed window and roster */
+  GPtrArray *window;
+  GPtrArray *roster;
+  GQueue *history;               /* YggdrasilLines, oldest first */
+  GHashTable *members;           /* YggdrasilNicks of the roster */
+  char *topic;
+  YggdrasilNowPlaying *playing;  /* named in topic */
+} YggdrasilMonitor;
+
+static YggdrasilMonitor monitor;
+
+/*
+ * records
+ */
+static void record(const char *kind, const char *text) {
+  const char *p;
+
+  printf("%ld\t%s\t", (long)time(NULL), kind);
+  for (p = text; *p; p++) {
+    switch (*p) {
+    case '\\': fputs("\\\\", stdout); break;
+    case '\t': fputs("\\t", stdout); break;
+    case '\n': fputs("\\n", stdout); break;
+    case '\r': fputs("\\r", stdout); break;
+    default: putchar(*p);
+    }
+  }
+  putchar('\n');
+}
+
+/*
+ * the event loop, as the core sees it
+ */
+typedef struct {
+  YggdrasilInputFunction func;
+  gpointer data;
+  int fd;
+} MonitorWatch;
+
+static gboolean monitor_watch_cb(GIOChannel *source, GIOCondition condition,
+                                 gpointer data) {
+  MonitorWatch *watch = (MonitorWatch *)data;
+  YggdrasilInputCondition cond = 0;
+
+  if (condition & (G_IO_IN | G_IO_HUP | G_IO_ERR))
+    cond |= YGGDRASIL_INPUT_READ;
+  if (condition & (G_IO_OUT | G_IO_HUP | G_IO_ERR))
+    cond |= YGGDRASIL_INPUT_WRITE;
+  watch->func(watch->data, watch->fd, cond);
+  return TRUE;
+}
+
+static guint monitor_input_add(int fd, YggdrasilInputCondition cond,
+                               YggdrasilInputFunction func, gpointer data) {
+  MonitorWatch *watch = g_new0(MonitorWatch, 1);
+  GIOCondition condition = 0;
+  GIOChannel *channel;
+  guint source;
+
+  watch->func = func;
+  watch->data = data;
+  watch->fd = fd;
+
+  if (cond & YGGDRASIL_INPUT_READ)
+    condition |= G_IO_IN | G_IO_HUP | G_IO_ERR;
+  if (cond & YGGDRASIL_INPUT_WRITE)
+    condition |= G_IO_OUT | G_IO_HUP | G_IO_ERR;
+
+#ifdef G_OS_WIN32
+  channel = g_io_channel_win32_new_socket(fd);
+#else
+  channel = g_io_channel_unix_new(fd);
+#endif
+  source = g_io_add_watch_full(channel, G_PRIORITY_DEFAULT, condition,
+                               monitor_watch_cb, watch, g_free);
+  g_io_channel_unref(channel);
+  return source;
+}
+
+static void monitor_debug(gboolean error, const char *message) {
+  if (error || monitor.verbose)
+    fputs(message, stderr);
+}
+
+static void monitor_breaker_changed(const char *endpoint, gboolean open,
+                                    int cooldown) {
+  record(open ? "down" : "up", endpoint);
+}
+
+static const YggdrasilCoreOps monitor_ops = {
+  g_timeout_add,
+  g_timeout_add_seconds,
+  g_source_remove,
+  monitor_input_add,
+  g_source_remove,
+  monitor_debug,
+  monitor_breaker_changed,
+  "yggdrasil-monitor"
+};
+
+/*
+ * polling
+ */
+static void chatread_chat_cb(YggdrasilFetch *fetch, gpointer userdata,
+                             const char *body, gsize len,
+                             const char *error_message) {
+  GList *retracted = NULL, *l;
+  guint i;
+
+  monitor.chat_fetch = NULL;
+  if (error_message) {
+    fprintf(stderr, "yggdrasil-monitor: chatread failed: %s\n",
+            error_message);
+    YGGDRASIL_METRIC(YGGDRASIL_METRIC_POLL_FAILURES, 1);
+    return;
+  }
+  YGGDRASIL_METRIC(YGGDRASIL_METRIC_POLLS, 1);
+  YGGDRASIL_METRIC(YGGDRASIL_METRIC_POLL_BYTES, len);
+  YGGDRASIL_METRIC_SINCE(YGGDRASIL_METRIC_POLL_SECONDS,
+                         monitor.chat_fetch_at);
+
+  yggdrasil_parse_chat_window(&monitor.arena, body, NULL, monitor.window);
+  i = yggdrasil_history_delta(monitor.history, monitor.window, &retracted);
+  for (l = retracted; l; l = l->next)
+    record("undo", ((YggdrasilLine *)l->data)->text);
+  g_list_free_full(retracted, yggdrasil_line_free);
+
+  for (; i < monitor.window->len; i++) {
+    const char *line = g_ptr_array_index(monitor.window, i);
+    record("msg", line);
+    yggdrasil_history_append(monitor.history, line, time(NULL));
+    YGGDRASIL_METRIC(YGGDRASIL_METRIC_MESSAGES, 1);
+  }
+  g_ptr_array_set_size(monitor.window, 0);
+  yggdrasil_arena_reset(&monitor.arena);
+}
+
+static void chatread_status_cb(YggdrasilFetch *fetch, gpointer userdata,
+                               const char *body, gsize len,
+                               const char *error_message) {
+  GList *joined = NULL, *left = NULL;
+  GList *l;
+  char *topic;
+
+  monitor.status_fetch = NULL;
+  if (error_message) {
+    fprintf(stderr, "yggdrasil-monitor: chatread failed: %s\n",
+            error_message);
+    YGGDRASIL_METRIC(YGGDRASIL_METRIC_POLL_FAILURES, 1);
+    return;
+  }
+  YGGDRASIL_METRIC(YGGDRASIL_METRIC_POLLS, 1);
+  YGGDRASIL_METRIC(YGGDRASIL_METRIC_POLL_BYTES, len);
+
+  YGGDRASIL_METRIC_SINCE(YGGDRASIL_METRIC_POLL_SECONDS,
+                         monitor.status_fetch_at);
+
+  topic = yggdrasil_parse_status_field(&monitor.arena, body, 1);
+  if (topic && g_strcmp0(topic, monitor.topic)) {
+    YggdrasilNowPlaying *np = yggdrasil_parse_now_playing(topic);
+
+    record("topic", topic);
+    g_free(monitor.topic);
+    monitor.topic = g_strdup(topic);
+
+    if (np && !(monitor.playing &&
+                yggdrasil_now_playing_same(np, monitor.playing))) {
+      char *track = yggdrasil_now_playing_describe(np);
+      record("track", track);
+      g_free(track);
+      yggdrasil_now_playing_free(monitor.playing);
+      monitor.playing = np;
+    } else {
+      yggdrasil_now_playing_free(np);
+    }
+  }
+
+  yggdrasil_parse_users(&monitor.arena, body, NULL, monitor.roster);
+  YGGDRASIL_METRIC(YGGDRASIL_METRIC_ROSTER_SIZE, monitor.roster->len);
+  yggdrasil_roster_diff(monitor.members, monitor.roster, &joined, &left);
+  for (l = left; l; l = l->next)
+    record("part", ((YggdrasilNick *)l->data)->name);
+  for (l = joined; l; l = l->next)
+    record("join", ((YggdrasilNick *)l->data)->name);
+  g_list_free(joined);
+  g_list_free_full(left, yggdrasil_nick_unref);
+
+  g_ptr_array_set_size(monitor.roster, 0);
+  yggdrasil_arena_reset(&monitor.arena);
+}
+
+/* polls chatread.php, unless the previous poll is still in flight */
+static gboolean poll_cb(gpointer data) {
+  char *url;
+
+  if (!monitor.chat_fetch) {
+    url = g_strdup_printf(YGGDRASIL_URL_CHATREAD, YGGDRASIL_CHATREAD_LINES);
+    monitor.chat_fetch = yggdrasil_fetch(url, &yggdrasil_fetch_policy_poll,
+                                         chatread_chat_cb, NULL);
+    monitor.chat_fetch_at = YGGDRASIL_METRIC_NOW();
+    g_free(url);
+  }
+  if (!monitor.status_fetch) {
+    url = g_strdup_printf(YGGDRASIL_URL_CHATREAD, 0);
+    monitor.status_fetch = yggdrasil_fetch(url, &yggdrasil_fetch_policy_poll,
+                                           chatread_status_cb, NULL);
+    monitor.status_fetch_at = YGGDRASIL_METRIC_NOW();
+    g_free(url);
+  }
+  return TRUE;
+}
+
+/*
+ * login
+ */
+static void login_cb(YggdrasilFetch *fetch, gpointer userdata,
+                     const char *body, gsize len, const char *error_message) {
+  char *chat, *search, *subdomain;
+
+  monitor.login_fetch = NULL;
+
+  if (error_message) {
+    fprintf(stderr, "yggdrasil-monitor: can't log in: %s\n", error_message);
+    monitor.status = EXIT_FAILURE;
+    g_main_loop_quit(monitor.loop);
+    return;
+  }
+  if (!yggdrasil_parse_auth(body, &chat, &search, &subdomain)) {
+    fprintf(stderr, "yggdrasil-monitor: incorrect username or password\n");
+    monitor.status = EXIT_FAILURE;
+    g_main_loop_quit(monitor.loop);
+    return;
+  }
+
+  /* chatread.php doesn't take the tokens; logging in only checks the
+   * account, as the prpl does before it joins the intercom */
+  g_free(chat);
+  g_free(search);
+  g_free(subdomain);
+
+  poll_cb(NULL);
+  monitor.poll_timer = yggdrasil_poll_timer_add(monitor.mode, poll_cb, NULL);
+}
+
+static void login_start(const char *username, const char *password) {
+  char *escaped_username = url_encode(username);
+  char *escaped_password = url_encode(password);
+  char *login_url = g_strdup_printf(YGGDRASIL_URL_LOGIN,
+                                    escaped_username, escaped_password);
+
+  monitor.login_fetch = yggdrasil_fetch(login_url,
+                                        &yggdrasil_fetch_policy_login,
+                                        login_cb, NULL);
+
+  g_free(login_url);
+  free(escaped_username);
+  free(escaped_password);
+}
+
+#ifdef G_OS_UNIX
+static gboolean quit_cb(gpointer data) {
+  g_main_loop_quit(monitor.loop);
+  return TRUE;
+}
+#endif
+
+int main(int argc, char **argv) {
+  static char *mode = NULL;
+  static gboolean verbose = FALSE;
+  static GOptionEntry entries[] = {
+    { "mode", 'm', 0, G_OPTION_ARG_STRING, &mode,
+      "Poll at the rate of an active, background or away chat "
+      "(default active)", "MODE" },
+    { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose,
+      "Log the core's debug output to stderr", NULL },
+    { NULL }
+  };
+  GOptionContext *context;
+  GError *error = NULL;
+  const char *password = g_getenv(MONITOR_ENV_PASSWORD);
+
+  context = g_option_context_new("USERNAME - stream the YggdrasilRadio "
+                                 "intercom to stdout");
+  g_option_context_add_main_entries(context, entries, NULL);
+  if (!g_option_context_parse(context, &argc, &argv, &error)) {
+    fprintf(stderr, "yggdrasil-monitor: %s\n", error->message);
+    g_error_free(error);
+    g_option_context_free(context);
+    return EXIT_FAILURE;
+  }
+  g_option_context_free(context);
+
+  if (argc != 2) {
+    fprintf(stderr, "usage: yggdrasil-monitor [-m MODE] [-v] USERNAME\n");
+    return EXIT_FAILURE;
+  }
+  if (!password) {
+    fprintf(stderr, "yggdrasil-monitor: set %s to the account's password\n",
+            MONITOR_ENV_PASSWORD);
+    return EXIT_FAILURE;
+  }
+
+  if (!mode || !strcmp(mode, "active")) {
+    monitor.mode = YGGDRASIL_POLL_ACTIVE;
+  } else if (!strcmp(mode, "background")) {
+    monitor.mode = YGGDRASIL_POLL_BACKGROUND;
+  } else if (!strcmp(mode, "away")) {
+    monitor.mode = YGGDRASIL_POLL_AWAY;
+  } else {
+    fprintf(stderr, "yggdrasil-monitor: unknown mode %s\n", mode);
+    return EXIT_FAILURE;
+  }
+  monitor.verbose = verbose;
+
+  /* records are read as they come */
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  monitor.loop = g_main_loop_new(NULL, FALSE);
+  monitor.status = EXIT_SUCCESS;
+  monitor.window = g_ptr_array_new();
+  monitor.roster = g_ptr_array_new();
+  monitor.history = g_queue_new();
+  monitor.members = yggdrasil_members_new();
+
+#ifdef G_OS_UNIX
+  g_unix_signal_add(SIGINT, quit_cb, NULL);
+  g_unix_signal_add(SIGTERM, quit_cb, NULL);
+#endif
+
+  yggdrasil_core_init(&monitor_ops);
+  login_start(argv[1], password);
+  g_main_loop_run(monitor.loop);
+
+  if (monitor.poll_timer)
+    g_source_remove(monitor.poll_timer);
+  if (monitor.login_fetch)
+    yggdrasil_fetch_cancel(monitor.login_fetch);
+  if (monitor.chat_fetch)
+    yggdrasil_fetch_cancel(monitor.chat_fetch);
+  if (monitor.status_fetch)
+    yggdrasil_fetch_cancel(monitor.status_fetch);
+
+  g_hash_table_destroy(monitor.members);
+  g_queue_free_full(monitor.history, yggdrasil_line_free);
+  g_ptr_array_free(monitor.roster, TRUE);
+  g_ptr_array_free(monitor.window, TRUE);
+  yggdrasil_arena_clear(&monitor.arena);
+  g_free(monitor.topic);
+  yggdrasil_now_playing_free(monitor.playing);
+  g_main_loop_unref(monitor.loop);
+
+  yggdrasil_core_shutdown();
+  return monitor.status;
+}
@@ -12,8 +12,6 @@
  *
  * The only feature currently supported is intercom/chat.
  *
- * FIXME: Paths are currently hardcoded for linux-like operating systems.
- *
  * TODO: I have no idea how to create "Makefiles". I compiled this by hacking
  *       the upstream makefile mechanisms, adding "yggdrasil" into the list of
  *       supported protocols, then running ./configure
@@ -42,9 +40,10 @@
 
 #include <string.h>
 #include <time.h>
-#include <signal.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#include <curl/curl.h>
 #include <glib.h>
 
 /* If you're using this as the basis of a prpl that will be distributed
@@ -64,10 +63,14 @@
 #include "privacy.h"
 #include "prpl.h"
 #include "roomlist.h"
+#include "signals.h"
 #include "status.h"
 #include "util.h"
+#include "value.h"
 #include "version.h"
 
+#include "yggdrasil-core.h"
+
 
 #define YGGDRASILPRPL_ID "prpl-yggdrasil"
 static PurplePlugin *_yggdrasil_protocol = NULL;
@@ -77,19 +80,41 @@ static PurplePlugin *_yggdrasil_protocol = NULL;
 #define YGGDRASIL_STATUS_OFFLINE  "offline"
 #define YGGDRASIL_NETWORK         "yggdrasilradio.net"
 #define PLUGIN_DEBUG_NAME    "yggdrasilprpl"
-#define YGGDRASIL_DATA_AUTH  "/tmp/yggdrasil.auth.txt"
-#define YGGDRASIL_DATA_CHAT_LOG  "/tmp/yggdrasil.chat.log.txt"
-#define YGGDRASIL_DATA_CHAT_NEW  "/tmp/yggdrasil.chat.new.txt"
-#define YGGDRASIL_DATA_CHAT_TMP  "/tmp/yggdrasil.chat.tmp.txt"
-#define YGGDRASIL_DATA_TOPIC  "/tmp/yggdrasil.topic.txt"
-#define YGGDRASIL_DATA_USERS  "/tmp/yggdrasil.users.txt"
-
-#define YGGDRASIL_REFRESH_CHAT_INTERVAL   10
-
-#define CURL_MAX_BUF	65536
-
-char wr_buf[CURL_MAX_BUF+1];
-int  wr_index;
+#define YGGDRASIL_DATA_DIR  "yggdrasil"   /* under purple_user_dir() */
+
+/* answers from the station's track search, kept per connection */
+#define YGGDRASIL_TRACK_CACHE_MAX   32              /* queries */
+#define YGGDRASIL_TRACK_CACHE_TTL   (15 * 60)       /* seconds */
+
+/* listener profiles, fetched for get_info and in the background for tooltips */
+#define YGGDRASIL_PROFILE_CACHE_MAX     200
+#define YGGDRASIL_PROFILE_TTL           (30 * 60)   /* seconds */
+#define YGGDRASIL_PROFILE_PREWARM_MAX   100         /* names waiting */
+#define YGGDRASIL_PROFILE_PREWARM_INTERVAL  1000    /* ms between fetches */
+
+#define YGGDRASIL_ARCHIVE_SHOW_MAX        1000  /* lines shown by /archive */
+#define YGGDRASIL_SEARCH_SHOW_MAX         25    /* matches shown by /search */
+#define YGGDRASIL_PLAYED_MAX              50    /* tracks kept for /played */
+#define YGGDRASIL_PLAYED_SHOW             10    /* shown by a bare /played */
+
+/* account settings caching the login.php tokens between sessions */
+#define YGGDRASIL_SETTING_AUTH_CHAT              "auth_chat"
+#define YGGDRASIL_SETTING_AUTH_SEARCH            "auth_search"
+#define YGGDRASIL_SETTING_AUTH_SEARCH_SUBDOMAIN  "auth_search_subdomain"
+#define YGGDRASIL_SETTING_AUTH_EXPIRES           "auth_expires"
+
+#define YGGDRASIL_AUTH_CACHE_TTL    (24 * 60 * 60)   /* seconds */
+
+/* outbound rate limiting: a token bucket refilled every
+ * YGGDRASIL_SEND_INTERVAL, holding up to the account's "send_burst" tokens */
+#define YGGDRASIL_SETTING_SEND_BURST  "send_burst"
+#define YGGDRASIL_SEND_BURST          3
+#define YGGDRASIL_SEND_INTERVAL       2000   /* ms per token */
+#define YGGDRASIL_OUTBOX_MAX          50     /* queued messages */
+#define YGGDRASIL_WRITE_MAX_LEN       1024   /* bytes of merged message */
+/* joins merged messages. plain text, so it reads the same once the chat
+ * line parser has been over it, whatever chatwrite.php makes of markup */
+#define YGGDRASIL_WRITE_SEPARATOR     " / "
 
 typedef void (*GcFunc)(PurpleConnection *from,
                        PurpleConnection *to,
@@ -101,17 +126,117 @@ typedef struct {
   gpointer userdata;
 } GcFuncData;
 
-char from_hex(char ch);
-char to_hex(char code);
-char *url_encode(const char *str);
+typedef struct {
+  guint queued;                  /* messages accepted into the outbox */
+  guint merged;                  /* messages folded into an earlier write */
+  guint dropped;                 /* messages refused, the outbox being full */
+  guint writes;                  /* chatwrite.php calls made */
+} YggdrasilSendStats;
 
-char AUTH_CHAT[80];
-char AUTH_SEARCH[80];
-char AUTH_SEARCH_SUBDOMAIN[80];
+/*
+ * the station's answer to a track search: rows of artist, title, album and
+ * length. cached by query, least recently used first out.
+ */
+typedef struct {
+  char *query;
+  GPtrArray *rows;               /* NULL-terminated string vectors */
+  time_t fetched;
+} YggdrasilTracks;
+
+typedef struct {
+  GHashTable *entries;           /* query -> YggdrasilTracks */
+  GQueue *lru;                   /* YggdrasilTracks, most recent first */
+} YggdrasilTrackCache;
+
+/*
+ * a listener's profile from profile.php, as label/value pairs. an empty
+ * profile is cached too, so unknown names aren't asked for again.
+ */
+typedef struct {
+  PurpleConnection *gc;
+  YggdrasilNick *nick;           /* normalized by profile_nick */
+  GPtrArray *fields;             /* {label, value} string vectors */
+  time_t fetched;                /* 0 until the first answer */
+  YggdrasilFetch *fetch;
+  gboolean show;                 /* open the info dialog when it arrives */
+} YggdrasilProfile;
+
+/*
+ * per-connection state, hung off gc->proto_data. allocated in
+ * yggdrasilprpl_login and freed in yggdrasilprpl_close.
+ */
+typedef struct {
+  PurpleConnection *gc;
+  YggdrasilFetch *login_fetch;   /* in-flight login.php request, if any */
+  gint64 login_at;               /* when login_fetch was made, for metrics */
+  char *auth_chat;
+  char *auth_search;
+  char *auth_search_subdomain;
+  GList *writes;                 /* YggdrasilWrites not yet acknowledged */
+  GQueue *outbox;                /* YggdrasilWrites waiting to be sent */
+  double send_tokens;
+  gint64 send_tokens_at;         /* monotonic time of the last refill */
+  guint send_timer;              /* waiting for a token */
+  YggdrasilSendStats send_stats;
+
+  int chat_id;                   /* the joined intercom, or 0 */
+  guint poll_timer;
+  YggdrasilPollMode poll_mode;   /* the rate poll_timer was started at */
+  gboolean idle;                 /* as last reported to set_idle */
+  YggdrasilFetch *chat_fetch;    /* in-flight chatread.php?n=15 */
+  YggdrasilFetch *status_fetch;  /* in-flight chatread.php?n=0 */
+  gint64 chat_fetch_at;          /* when they were made, for metrics */
+  gint64 status_fetch_at;
+  YggdrasilArena arena;          /* backs the parsed window and roster */
+  GPtrArray *window;             /* lines of the last chatread, in arena */
+  GPtrArray *roster;             /* "who @ where" of the last chatread */
+  GHashTable *members;           /* YggdrasilNicks of the roster in the chat */
+  YggdrasilFilter *filter;       /* from the privacy settings, or NULL */
+  char *topic;                   /* as last set on the chat */
+  GQueue *played;                /* YggdrasilNowPlayings, oldest first */
+
+  GQueue *history;               /* YggdrasilLines, oldest first */
+  GQueue *echoes;                /* YggdrasilEchoes of lines sent, oldest first */
+  YggdrasilArchive *archive;
+  YggdrasilSearchIndex *search;
+
+  YggdrasilTrackCache tracks;
+  YggdrasilFetch *track_fetch;   /* in-flight search.php, if any */
+  char *track_query;             /* what track_fetch is looking for */
+
+  GHashTable *profiles;          /* YggdrasilNick -> YggdrasilProfile */
+  GQueue *profile_lru;           /* YggdrasilProfiles, most recent first */
+  GQueue *prewarm;               /* YggdrasilNicks to fetch in the background */
+  guint prewarm_timer;
+
+  PurpleRoomlist *roomlist;      /* being filled in, if any */
+  GHashTable *roomlist_seen;     /* room names already listed */
+  YggdrasilFetch *roomlist_fetch;
+} YggdrasilConnection;
+
+/*
+ * a chatwrite.php call. a write that the server rejects is parked (fetch is
+ * NULL) while a fresh login runs, then retried once with the new token.
+ */
+typedef struct {
+  YggdrasilConnection *ya;
+  int id;                        /* chat id the message was sent from */
+  char *message;
+  gboolean retried;
+  YggdrasilFetch *fetch;
+  gint64 sent_at;                /* when fetch was made, for metrics */
+  guint echo_first;              /* ids of the local echoes of message */
+  guint echo_last;
+} YggdrasilWrite;
+
+static void write_send(YggdrasilWrite *write);
+static void write_free(YggdrasilWrite *write);
+static void write_fail(YggdrasilWrite *write);
+static void outbox_flush(YggdrasilConnection *ya);
 
 /*
  * stores offline messages that haven't been delivered yet. maps username
- * (char *) to GList * of GOfflineMessages. initialized in yggdrasilprpl_init.
+ * (char *) to GList * of GOfflineMessages. initialized in yggdrasilprpl_start.
  */
 GHashTable* goffline_messages = NULL;
 
@@ -122,30 +247,109 @@ typedef struct {
   PurpleMessageFlags flags;
 } GOfflineMessage;
 
+/*
+ * registry of the connected yggdrasilprpl accounts in this process and of
+ * the chats they've joined, so that fanning an event out to the other local
+ * accounts touches only them. maintained by login_finish, close, join_chat
+ * and chat_leave.
+ */
+static GHashTable *registry_gcs = NULL;     /* normalized username -> gc */
+static GHashTable *registry_chats = NULL;   /* chat id -> GList of convs */
+
+/* ids of the local echoes of sent chat messages */
+static guint echo_serial = 0;
+
+static void registry_add_gc(PurpleConnection *gc) {
+  if (!registry_gcs)
+    registry_gcs = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                         g_free, NULL);
+  g_hash_table_replace(registry_gcs,
+                       g_strdup(purple_normalize(NULL, gc->account->username)),
+                       gc);
+}
+
+static void registry_join(PurpleConversation *conv) {
+  gpointer id = GINT_TO_POINTER(purple_conv_chat_get_id(
+                                  purple_conversation_get_chat_data(conv)));
+  GList *members;
+
+  if (!registry_chats)
+    registry_chats = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                           NULL, (GDestroyNotify)g_list_free);
+  members = g_hash_table_lookup(registry_chats, id);
+  if (!g_list_find(members, conv)) {
+    /* steal, so the replaced list isn't freed */
+    g_hash_table_steal(registry_chats, id);
+    g_hash_table_insert(registry_chats, id, g_list_prepend(members, conv));
+  }
+}
+
+/* drops conv, or every conversation of the connection who, from a chat */
+static void registry_drop_member(gpointer id, GList *members, gpointer who) {
+  GList *l = members;
+
+  while (l) {
+    GList *next = l->next;
+    PurpleConversation *conv = (PurpleConversation *)l->data;
+    if (conv == who || purple_conversation_get_gc(conv) == who)
+      members = g_list_delete_link(members, l);
+    l = next;
+  }
+
+  /* the list head may have changed, so the value is always replaced */
+  g_hash_table_steal(registry_chats, id);
+  if (members)
+    g_hash_table_insert(registry_chats, id, members);
+}
+
+static void registry_leave(PurpleConversation *conv) {
+  gpointer id = GINT_TO_POINTER(purple_conv_chat_get_id(
+                                  purple_conversation_get_chat_data(conv)));
+  GList *members;
+
+  if (!registry_chats)
+    return;
+  members = g_hash_table_lookup(registry_chats, id);
+  if (members)
+    registry_drop_member(id, members, conv);
+}
+
+static void registry_remove_gc(PurpleConnection *gc) {
+  const char *username = purple_normalize(NULL, gc->account->username);
+  GList *ids, *l;
+
+  if (registry_gcs && g_hash_table_lookup(registry_gcs, username) == gc)
+    g_hash_table_remove(registry_gcs, username);
+
+  /* purple marks the chats left without calling chat_leave */
+  if (registry_chats) {
+    ids = g_hash_table_get_keys(registry_chats);
+    for (l = ids; l; l = l->next)
+      registry_drop_member(l->data,
+                           g_hash_table_lookup(registry_chats, l->data), gc);
+    g_list_free(ids);
+  }
+}
+
 /*
  * helpers
  */
 static PurpleConnection *get_yggdrasilprpl_gc(const char *username) {
-  PurpleAccount *acct = purple_accounts_find(username, YGGDRASILPRPL_ID);
-  if (acct && purple_account_is_connected(acct))
-    return acct->gc;
-  else
+  if (!registry_gcs)
     return NULL;
+  return g_hash_table_lookup(registry_gcs, purple_normalize(NULL, username));
 }
 
-static void call_if_yggdrasilprpl(gpointer data, gpointer userdata) {
-  PurpleConnection *gc = (PurpleConnection *)(data);
+static void call_gc_func(gpointer key, gpointer value, gpointer userdata) {
   GcFuncData *gcfdata = (GcFuncData *)userdata;
-
-  if (!strcmp(gc->account->protocol_id, YGGDRASILPRPL_ID))
-    gcfdata->fn(gcfdata->from, gc, gcfdata->userdata);
+  gcfdata->fn(gcfdata->from, (PurpleConnection *)value, gcfdata->userdata);
 }
 
 static void foreach_yggdrasilprpl_gc(GcFunc fn, PurpleConnection *from,
                                 gpointer userdata) {
   GcFuncData gcfdata = { fn, from, userdata };
-  g_list_foreach(purple_connections_get_all(), call_if_yggdrasilprpl,
-                 &gcfdata);
+  if (registry_gcs)
+    g_hash_table_foreach(registry_gcs, call_gc_func, &gcfdata);
 }
 
 
@@ -159,42 +363,160 @@ typedef struct {
 } ChatFuncData;
 
 static void call_chat_func(gpointer data, gpointer userdata) {
-  PurpleConnection *to = (PurpleConnection *)data;
+  PurpleConversation *conv = (PurpleConversation *)data;
   ChatFuncData *cfdata = (ChatFuncData *)userdata;
+  PurpleConvChat *chat = purple_conversation_get_chat_data(conv);
 
-  int id = cfdata->from_chat->id;
-  PurpleConversation *conv = purple_find_chat(to, id);
-  if (conv) {
-    PurpleConvChat *chat = purple_conversation_get_chat_data(conv);
-    cfdata->fn(cfdata->from_chat, chat, id, conv->name, cfdata->userdata);
-  }
+  cfdata->fn(cfdata->from_chat, chat, cfdata->from_chat->id, conv->name,
+             cfdata->userdata);
 }
 
 static void foreach_gc_in_chat(ChatFunc fn, PurpleConnection *from,
                                int id, gpointer userdata) {
-  PurpleConversation *conv = purple_find_chat(from, id);
-  ChatFuncData cfdata = { fn,
-                          purple_conversation_get_chat_data(conv),
-                          userdata };
-  g_list_foreach(purple_connections_get_all(), call_chat_func,
-                 &cfdata);
-}
-
-static PurpleConversation *current_conv;
-static PurpleConvChat *current_chat;
-static void yggdrasilprpl_chat_update_convo(PurpleConvChat *chat);
-static void yggdrasilprpl_chat_update_topic(PurpleConvChat *chat);
-static void yggdrasilprpl_chat_update_users(PurpleConvChat *chat, const char *account_username);
-static void chatread();
-
-static void refresh(int signal_code){
-  signal(SIGALRM, SIG_IGN);
-  chatread();
-  yggdrasilprpl_chat_update_topic(current_chat);
-  yggdrasilprpl_chat_update_users(current_chat, "");
-  yggdrasilprpl_chat_update_convo(current_chat);
-  signal(SIGALRM, refresh);
-  alarm(YGGDRASIL_REFRESH_CHAT_INTERVAL);
+  GList *members = registry_chats ?
+    g_hash_table_lookup(registry_chats, GINT_TO_POINTER(id)) : NULL;
+  ChatFuncData cfdata = { fn, NULL, userdata };
+  GList *l;
+
+  for (l = members; l && !cfdata.from_chat; l = l->next)
+    if (purple_conversation_get_gc(l->data) == from)
+      cfdata.from_chat = purple_conversation_get_chat_data(l->data);
+
+  if (cfdata.from_chat)
+    g_list_foreach(members, call_chat_func, &cfdata);
+}
+
+static void yggdrasilprpl_chat_update_convo(PurpleConvChat *chat,
+                                           GPtrArray *window);
+static void yggdrasilprpl_chat_update_topic(PurpleConvChat *chat,
+                                           const char *topic);
+static void yggdrasilprpl_chat_update_users(PurpleConvChat *chat,
+                                           GHashTable *members,
+                                           GPtrArray *users);
+static void chatread(YggdrasilConnection *ya, int lines);
+static void profile_prewarm(YggdrasilConnection *ya, const char *who);
+
+/* the intercom conversation of a connection, if it has been joined */
+static PurpleConvChat *yggdrasil_chat(YggdrasilConnection *ya) {
+  PurpleConversation *conv;
+
+  if (!ya->chat_id)
+    return NULL;
+  conv = purple_find_chat(ya->gc, ya->chat_id);
+  return conv ? purple_conversation_get_chat_data(conv) : NULL;
+}
+
+/* tells every joined intercom when an endpoint stops or starts answering */
+static void breaker_changed(const char *endpoint, gboolean open,
+                            int cooldown) {
+  GHashTableIter iter;
+  gpointer value;
+  char *msg;
+
+  if (!open)
+    msg = g_strdup_printf(_("%s is answering again."), endpoint);
+  else
+    msg = g_strdup_printf(_("%s is not responding; trying again in %d "
+                            "seconds."), endpoint, cooldown);
+
+  if (!registry_gcs) {
+    g_free(msg);
+    return;
+  }
+
+  g_hash_table_iter_init(&iter, registry_gcs);
+  while (g_hash_table_iter_next(&iter, NULL, &value)) {
+    PurpleConnection *gc = (PurpleConnection *)value;
+    PurpleConvChat *chat;
+
+    if (!gc->proto_data)
+      continue;
+    chat = yggdrasil_chat(gc->proto_data);
+    if (chat)
+      purple_conv_chat_write(chat, "", msg,
+                             PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_NO_LOG,
+                             time(NULL));
+  }
+  g_free(msg);
+}
+
+static YggdrasilPollMode poll_mode(YggdrasilConnection *ya) {
+  PurpleStatus *status = purple_account_get_active_status(ya->gc->account);
+  PurpleConversation *conv = purple_find_chat(ya->gc, ya->chat_id);
+
+  if (ya->idle || !purple_status_is_available(status))
+    return YGGDRASIL_POLL_AWAY;
+  if (conv && !purple_conversation_has_focus(conv))
+    return YGGDRASIL_POLL_BACKGROUND;
+  return YGGDRASIL_POLL_ACTIVE;
+}
+
+static gboolean refresh(gpointer data);
+
+/*
+ * (re)starts the poll timer at the rate the current presence and focus call
+ * for. coming back to the chat from a slower rate first catches up with one
+ * wide chatread, since the slow polls may have missed lines.
+ */
+static void poll_schedule(YggdrasilConnection *ya) {
+  YggdrasilPollMode mode;
+
+  if (!ya->chat_id)
+    return;
+
+  mode = poll_mode(ya);
+  if (ya->poll_timer && mode == ya->poll_mode)
+    return;
+
+  if (mode == YGGDRASIL_POLL_ACTIVE && ya->poll_mode != YGGDRASIL_POLL_ACTIVE)
+    chatread(ya, YGGDRASIL_CATCHUP_LINES);
+  else if (ya->poll_timer && ya->poll_mode == YGGDRASIL_POLL_AWAY)
+    /* the station has likely dropped the connection while we were away;
+     * reopen it before something is said */
+    yggdrasil_fetch_prewarm(YGGDRASIL_URL_HOME);
+
+  if (ya->poll_timer)
+    purple_timeout_remove(ya->poll_timer);
+  ya->poll_mode = mode;
+  ya->poll_timer = yggdrasil_poll_timer_add(mode, refresh, ya);
+
+  purple_debug_info(PLUGIN_DEBUG_NAME, "polling %s every %d seconds\n",
+                    ya->gc->account->username, yggdrasil_poll_seconds(mode));
+}
+
+static gboolean refresh(gpointer data) {
+  YggdrasilConnection *ya = (YggdrasilConnection *)data;
+
+  YGGDRASIL_STAGE_ENTER(YGGDRASIL_STAGE_REFRESH);
+  if (poll_mode(ya) != ya->poll_mode) {
+    /* poll_schedule replaces this timer */
+    ya->poll_timer = 0;
+    poll_schedule(ya);
+    YGGDRASIL_STAGE_LEAVE(YGGDRASIL_STAGE_REFRESH);
+    return FALSE;
+  }
+
+  chatread(ya, YGGDRASIL_CHATREAD_LINES);
+  YGGDRASIL_STAGE_LEAVE(YGGDRASIL_STAGE_REFRESH);
+  return TRUE;
+}
+
+/* focusing a conversation marks it seen; that is our cue that someone is
+ * watching the intercom again */
+static void conversation_updated_cb(PurpleConversation *conv,
+                                    PurpleConvUpdateType type) {
+  PurpleConnection *gc;
+  YggdrasilConnection *ya;
+
+  if (type != PURPLE_CONV_UPDATE_UNSEEN ||
+      purple_conversation_get_type(conv) != PURPLE_CONV_TYPE_CHAT ||
+      strcmp(conv->account->protocol_id, YGGDRASILPRPL_ID))
+    return;
+
+  gc = purple_conversation_get_gc(conv);
+  ya = gc ? gc->proto_data : NULL;
+  if (ya && purple_conversation_get_chat_data(conv)->id == ya->chat_id)
+    poll_schedule(ya);
 }
 
 static void discover_status(PurpleConnection *from, PurpleConnection *to,
@@ -229,20 +551,525 @@ static void report_status_change(PurpleConnection *from, PurpleConnection *to,
   discover_status(to, from, NULL);
 }
 
-static void chatread(void);
-static void chatread(){
-  int ret;
-  ret = system("curl --silent http://yggdrasilradio.net/chatread.php?n=15 | head -n -1 | tail -n +2 | sed -e 's#<br>##g' -e 's#&nbsp;# #g' > /tmp/yggdrasil.chat.tmp.txt");
-  if(ret) printf("problem?");
-  ret = system("curl --silent http://yggdrasilradio.net/chatread.php?n=0 | cut -d '|' -f 2 > /tmp/yggdrasil.topic.txt");
-  if(ret) printf("problem?");
-  ret = system("curl --silent http://yggdrasilradio.net/chatread.php?n=0 | cut -d '|' -f 4 | sed -e 's#</span>, #</span>\\n#g' -e 's#</span><span#</span>\\n<span#g' | head -n -1 | sed 's#<span.*title=\"\\(.*\\)\">\\(.*\\)</span>#\\2 @ \\1#g' > /tmp/yggdrasil.users.txt");
-  if(ret) printf("problem?");
+static void chatread_chat_cb(YggdrasilFetch *fetch, gpointer userdata,
+                             const char *body, gsize len,
+                             const char *error_message) {
+  YggdrasilConnection *ya = (YggdrasilConnection *)userdata;
+  PurpleConvChat *chat = yggdrasil_chat(ya);
+
+  ya->chat_fetch = NULL;
+  if (error_message) {
+    purple_debug_error(PLUGIN_DEBUG_NAME, "chatread failed: %s\n",
+                       error_message);
+    YGGDRASIL_METRIC(YGGDRASIL_METRIC_POLL_FAILURES, 1);
+    return;
+  }
+  YGGDRASIL_METRIC(YGGDRASIL_METRIC_POLLS, 1);
+  YGGDRASIL_METRIC(YGGDRASIL_METRIC_POLL_BYTES, len);
+  YGGDRASIL_METRIC_SINCE(YGGDRASIL_METRIC_POLL_SECONDS, ya->chat_fetch_at);
+
+  if (chat) {
+    gint64 parse_at = YGGDRASIL_METRIC_NOW();
+
+    YGGDRASIL_STAGE_ENTER(YGGDRASIL_STAGE_PARSE);
+    yggdrasil_parse_chat_window(&ya->arena, body, ya->filter, ya->window);
+    YGGDRASIL_STAGE_LEAVE(YGGDRASIL_STAGE_PARSE);
+    YGGDRASIL_METRIC_SINCE(YGGDRASIL_METRIC_PARSE_SECONDS, parse_at);
+    YGGDRASIL_STAGE_ENTER(YGGDRASIL_STAGE_UPDATE_CONVO);
+    yggdrasilprpl_chat_update_convo(chat, ya->window);
+    YGGDRASIL_STAGE_LEAVE(YGGDRASIL_STAGE_UPDATE_CONVO);
+    g_ptr_array_set_size(ya->window, 0);
+    yggdrasil_arena_reset(&ya->arena);
+  }
+}
+
+/*
+ * follows the track named in the topic. only a different artist or title is
+ * a change: it goes on ya->played and out with the "yggdrasil-track-changed"
+ * signal, so listeners hear about each track once rather than every poll.
+ */
+static void now_playing_update(YggdrasilConnection *ya, const char *topic) {
+  YggdrasilNowPlaying *np = yggdrasil_parse_now_playing(topic);
+  YggdrasilNowPlaying *last = g_queue_peek_tail(ya->played);
+
+  if (!np || (last && yggdrasil_now_playing_same(np, last))) {
+    yggdrasil_now_playing_free(np);
+    return;
+  }
+
+  g_queue_push_tail(ya->played, np);
+  while (g_queue_get_length(ya->played) > YGGDRASIL_PLAYED_MAX)
+    yggdrasil_now_playing_free(g_queue_pop_head(ya->played));
+
+  purple_debug_info(PLUGIN_DEBUG_NAME, "now playing: %s - %s (%s)\n",
+                    np->artist ? np->artist : "?", np->title,
+                    np->show ? np->show : "?");
+  purple_signal_emit(_yggdrasil_protocol, "yggdrasil-track-changed",
+                     ya->gc->account, np->artist, np->title, np->show);
+}
+
+static void chatread_status_cb(YggdrasilFetch *fetch, gpointer userdata,
+                               const char *body, gsize len,
+                               const char *error_message) {
+  YggdrasilConnection *ya = (YggdrasilConnection *)userdata;
+  PurpleConvChat *chat = yggdrasil_chat(ya);
+  char *topic;
+  guint i;
+
+  ya->status_fetch = NULL;
+  if (error_message) {
+    purple_debug_error(PLUGIN_DEBUG_NAME, "chatread failed: %s\n",
+                       error_message);
+    YGGDRASIL_METRIC(YGGDRASIL_METRIC_POLL_FAILURES, 1);
+    return;
+  }
+  YGGDRASIL_METRIC(YGGDRASIL_METRIC_POLLS, 1);
+  YGGDRASIL_METRIC(YGGDRASIL_METRIC_POLL_BYTES, len);
+  YGGDRASIL_METRIC_SINCE(YGGDRASIL_METRIC_POLL_SECONDS, ya->status_fetch_at);
+
+  if (chat) {
+    gint64 parse_at = YGGDRASIL_METRIC_NOW();
+
+    YGGDRASIL_STAGE_ENTER(YGGDRASIL_STAGE_PARSE);
+    topic = yggdrasil_parse_status_field(&ya->arena, body, 1);
+    yggdrasil_parse_users(&ya->arena, body, ya->filter, ya->roster);
+    YGGDRASIL_STAGE_LEAVE(YGGDRASIL_STAGE_PARSE);
+    YGGDRASIL_METRIC_SINCE(YGGDRASIL_METRIC_PARSE_SECONDS, parse_at);
+    YGGDRASIL_METRIC(YGGDRASIL_METRIC_ROSTER_SIZE, ya->roster->len);
+
+    if (topic && g_strcmp0(topic, ya->topic)) {
+      YGGDRASIL_STAGE_ENTER(YGGDRASIL_STAGE_UPDATE_TOPIC);
+      g_free(ya->topic);
+      ya->topic = g_strdup(topic);
+      yggdrasilprpl_chat_update_topic(chat, topic);
+      now_playing_update(ya, topic);
+      YGGDRASIL_STAGE_LEAVE(YGGDRASIL_STAGE_UPDATE_TOPIC);
+    }
+    YGGDRASIL_STAGE_ENTER(YGGDRASIL_STAGE_UPDATE_USERS);
+    yggdrasilprpl_chat_update_users(chat, ya->members, ya->roster);
+    YGGDRASIL_STAGE_LEAVE(YGGDRASIL_STAGE_UPDATE_USERS);
+    for (i = 0; i < ya->roster->len; i++)
+      profile_prewarm(ya, g_ptr_array_index(ya->roster, i));
+    g_ptr_array_set_size(ya->roster, 0);
+    yggdrasil_arena_reset(&ya->arena);
+  }
+}
+
+/*
+ * polls the last lines of chatread.php, unless the previous poll is still
+ * in flight. a wider poll replaces a narrower one that's in flight.
+ */
+static void chatread(YggdrasilConnection *ya, int lines) {
+  char *url;
+
+  if (!ya->chat_id)
+    return;
+
+  if (ya->chat_fetch && lines > YGGDRASIL_CHATREAD_LINES) {
+    yggdrasil_fetch_cancel(ya->chat_fetch);
+    ya->chat_fetch = NULL;
+  }
+  if (!ya->chat_fetch) {
+    url = g_strdup_printf(YGGDRASIL_URL_CHATREAD, lines);
+    ya->chat_fetch = yggdrasil_fetch(url, &yggdrasil_fetch_policy_poll,
+                                     chatread_chat_cb, ya);
+    ya->chat_fetch_at = YGGDRASIL_METRIC_NOW();
+    g_free(url);
+  }
+  if (!ya->status_fetch) {
+    url = g_strdup_printf(YGGDRASIL_URL_CHATREAD, 0);
+    ya->status_fetch = yggdrasil_fetch(url, &yggdrasil_fetch_policy_poll,
+                                       chatread_status_cb, ya);
+    ya->status_fetch_at = YGGDRASIL_METRIC_NOW();
+    g_free(url);
+  }
+}
+
+/*
+ * track search. search.php lives on the subdomain login.php hands out with
+ * the search token, and answers one track per line as artist|title|album|length.
+ */
+static void tracks_free(gpointer data) {
+  YggdrasilTracks *tracks = (YggdrasilTracks *)data;
+  g_free(tracks->query);
+  g_ptr_array_free(tracks->rows, TRUE);
+  g_free(tracks);
+}
+
+/* returns the cached answer for query, if it's fresh, and marks it used */
+static YggdrasilTracks *track_cache_lookup(YggdrasilTrackCache *cache,
+                                           const char *query) {
+  YggdrasilTracks *tracks;
+
+  if (!cache->entries)
+    return NULL;
+  tracks = g_hash_table_lookup(cache->entries, query);
+  if (!tracks)
+    return NULL;
+
+  g_queue_remove(cache->lru, tracks);
+  if (time(NULL) - tracks->fetched > YGGDRASIL_TRACK_CACHE_TTL) {
+    g_hash_table_remove(cache->entries, query);
+    return NULL;
+  }
+  g_queue_push_head(cache->lru, tracks);
+  return tracks;
+}
+
+static void track_cache_store(YggdrasilTrackCache *cache,
+                              YggdrasilTracks *tracks) {
+  YggdrasilTracks *old;
+
+  if (!cache->entries) {
+    /* keys are owned by the values */
+    cache->entries = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                           NULL, tracks_free);
+    cache->lru = g_queue_new();
+  }
+
+  old = g_hash_table_lookup(cache->entries, tracks->query);
+  if (old) {
+    g_queue_remove(cache->lru, old);
+    g_hash_table_remove(cache->entries, tracks->query);
+  }
+  g_hash_table_insert(cache->entries, tracks->query, tracks);
+  g_queue_push_head(cache->lru, tracks);
+
+  while (g_queue_get_length(cache->lru) > YGGDRASIL_TRACK_CACHE_MAX) {
+    old = g_queue_pop_tail(cache->lru);
+    g_hash_table_remove(cache->entries, old->query);
+  }
+}
+
+static void track_cache_clear(YggdrasilTrackCache *cache) {
+  if (cache->entries) {
+    g_queue_free(cache->lru);
+    g_hash_table_destroy(cache->entries);
+    cache->entries = NULL;
+    cache->lru = NULL;
+  }
+}
+
+static void tracks_show(PurpleConnection *gc, YggdrasilTracks *tracks) {
+  static const char *columns[] = {
+    N_("Artist"), N_("Title"), N_("Album"), N_("Length")
+  };
+  PurpleNotifySearchResults *results;
+  char *secondary;
+  guint i, j;
+
+  if (!tracks->rows->len) {
+    purple_notify_info(gc, _("Track Search"), _("No tracks found."),
+                       tracks->query);
+    return;
+  }
+
+  results = purple_notify_searchresults_new();
+  for (j = 0; j < G_N_ELEMENTS(columns); j++)
+    purple_notify_searchresults_column_add(results,
+      purple_notify_searchresults_column_new(_(columns[j])));
+
+  for (i = 0; i < tracks->rows->len; i++) {
+    char **fields = g_ptr_array_index(tracks->rows, i);
+    GList *row = NULL;
+    gboolean more = TRUE;
+
+    for (j = 0; j < G_N_ELEMENTS(columns); j++) {
+      more = more && fields[j];
+      row = g_list_append(row, g_strdup(more ? fields[j] : ""));
+    }
+    purple_notify_searchresults_row_add(results, row);
+  }
+
+  secondary = g_strdup_printf(_("%u track(s) match \"%s\"."),
+                              tracks->rows->len, tracks->query);
+  purple_notify_searchresults(gc, _("Track Search"), _("Search Results"),
+                              secondary, results, NULL, NULL);
+  g_free(secondary);
+}
+
+static void track_search_cb(YggdrasilFetch *fetch, gpointer userdata,
+                            const char *body, gsize len,
+                            const char *error_message) {
+  YggdrasilConnection *ya = (YggdrasilConnection *)userdata;
+  YggdrasilTracks *tracks;
+
+  ya->track_fetch = NULL;
+  if (error_message) {
+    purple_notify_error(ya->gc, _("Track Search"),
+                        _("The station's search failed."), error_message);
+    g_free(ya->track_query);
+    ya->track_query = NULL;
+    return;
+  }
+
+  tracks = g_new0(YggdrasilTracks, 1);
+  tracks->query = ya->track_query;
+  tracks->rows = yggdrasil_parse_tracks(body);
+  tracks->fetched = time(NULL);
+  ya->track_query = NULL;
+
+  purple_debug_info(PLUGIN_DEBUG_NAME, "%u track(s) for \"%s\"\n",
+                    tracks->rows->len, tracks->query);
+  track_cache_store(&ya->tracks, tracks);
+  tracks_show(ya->gc, tracks);
+}
+
+/* searches the station's library, from the cache if it can */
+static void track_search(YggdrasilConnection *ya, const char *words) {
+  char *query = g_strstrip(g_ascii_strdown(words, -1));
+  YggdrasilTracks *tracks;
+  char *escaped, *url;
+
+  if (!*query) {
+    g_free(query);
+    return;
+  }
+
+  tracks = track_cache_lookup(&ya->tracks, query);
+  if (tracks) {
+    purple_debug_info(PLUGIN_DEBUG_NAME, "tracks for \"%s\" from cache\n",
+                      query);
+    tracks_show(ya->gc, tracks);
+    g_free(query);
+    return;
+  }
+
+  if (!ya->auth_search || !ya->auth_search_subdomain) {
+    purple_notify_error(ya->gc, _("Track Search"),
+                        _("Track search isn't available yet."),
+                        _("Wait for the login to finish and try again."));
+    g_free(query);
+    return;
+  }
+
+  /* only the latest search is worth finishing */
+  if (ya->track_fetch)
+    yggdrasil_fetch_cancel(ya->track_fetch);
+  g_free(ya->track_query);
+  ya->track_query = query;
+
+  escaped = url_encode(query);
+  url = g_strdup_printf(YGGDRASIL_URL_SEARCH, ya->auth_search_subdomain,
+                        ya->auth_search, escaped);
+  ya->track_fetch = yggdrasil_fetch(url, &yggdrasil_fetch_policy_poll,
+                                    track_search_cb, ya);
+  g_free(url);
+  free(escaped);
 }
 
 /*
- * UI callbacks
+ * listener profiles. profile.php answers one "label: value" line per field.
+ * get_info fetches on demand; the names in the intercom's user list are
+ * fetched in the background, one at a time, so tooltips can be filled in
+ * from the cache alone.
  */
+
+/* chat users are listed as "name @ where"; profiles are keyed by the
+ * lowercased name. returns a reference, or NULL when intern is FALSE and the
+ * name has never been seen */
+static YggdrasilNick *profile_nick(const char *who, gboolean intern) {
+  const char *at = strstr(who, " @ ");
+  char *name = g_strstrip(g_ascii_strdown(who, at ? at - who : -1));
+  YggdrasilNick *nick = NULL;
+
+  if (*name)
+    nick = intern ? yggdrasil_nick_intern(name) : yggdrasil_nick_lookup(name);
+  if (nick && !intern)
+    yggdrasil_nick_ref(nick);
+  g_free(name);
+  return nick;
+}
+
+static gboolean profile_fresh(const YggdrasilProfile *profile) {
+  return profile->fetched &&
+         time(NULL) - profile->fetched <= YGGDRASIL_PROFILE_TTL;
+}
+
+static void profile_free(gpointer data) {
+  YggdrasilProfile *profile = (YggdrasilProfile *)data;
+  if (profile->fetch)
+    yggdrasil_fetch_cancel(profile->fetch);
+  if (profile->fields)
+    g_ptr_array_free(profile->fields, TRUE);
+  yggdrasil_nick_unref(profile->nick);
+  g_free(profile);
+}
+
+/* looks up a profile, creating an empty one if asked, and marks it used */
+static YggdrasilProfile *profile_get(YggdrasilConnection *ya,
+                                     YggdrasilNick *nick, gboolean create) {
+  YggdrasilProfile *profile;
+  GList *link;
+
+  if (!nick)
+    return NULL;
+  if (!ya->profiles) {
+    if (!create)
+      return NULL;
+    /* keys are owned by the values */
+    ya->profiles = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                         NULL, profile_free);
+    ya->profile_lru = g_queue_new();
+  }
+
+  profile = g_hash_table_lookup(ya->profiles, nick);
+  if (profile) {
+    g_queue_remove(ya->profile_lru, profile);
+    g_queue_push_head(ya->profile_lru, profile);
+    return profile;
+  }
+  if (!create)
+    return NULL;
+
+  profile = g_new0(YggdrasilProfile, 1);
+  profile->gc = ya->gc;
+  profile->nick = yggdrasil_nick_ref(nick);
+  g_hash_table_insert(ya->profiles, nick, profile);
+  g_queue_push_head(ya->profile_lru, profile);
+
+  /* profiles still being fetched are kept, so a pending info dialog gets its
+   * answer; the cache can run over until they land */
+  link = g_queue_peek_tail_link(ya->profile_lru);
+  while (g_queue_get_length(ya->profile_lru) > YGGDRASIL_PROFILE_CACHE_MAX &&
+         link != g_queue_peek_head_link(ya->profile_lru)) {
+    GList *prev = link->prev;
+    YggdrasilProfile *old = link->data;
+
+    if (!old->fetch) {
+      g_queue_delete_link(ya->profile_lru, link);
+      g_hash_table_remove(ya->profiles, old->nick);
+    }
+    link = prev;
+  }
+  return profile;
+}
+
+static void profile_add_pairs(YggdrasilProfile *profile,
+                              PurpleNotifyUserInfo *info) {
+  guint i;
+
+  for (i = 0; profile->fields && i < profile->fields->len; i++) {
+    char **pair = g_ptr_array_index(profile->fields, i);
+    purple_notify_user_info_add_pair(info, pair[0], pair[1]);
+  }
+}
+
+static void profile_show(PurpleConnection *gc, YggdrasilProfile *profile,
+                         const char *status) {
+  PurpleNotifyUserInfo *info = purple_notify_user_info_new();
+
+  if (status)
+    purple_notify_user_info_add_pair(info, _("Info"), status);
+  else if (!profile->fields || !profile->fields->len)
+    purple_notify_user_info_add_pair(info, _("Info"), _("No user info."));
+  profile_add_pairs(profile, info);
+
+  /* a second call for the same name updates the open dialog */
+  purple_notify_userinfo(gc, profile->nick->name, info, NULL, NULL);
+  purple_notify_user_info_destroy(info);
+}
+
+static void profile_cb(YggdrasilFetch *fetch, gpointer userdata,
+                       const char *body, gsize len,
+                       const char *error_message) {
+  YggdrasilProfile *profile = (YggdrasilProfile *)userdata;
+
+  profile->fetch = NULL;
+  if (error_message) {
+    purple_debug_error(PLUGIN_DEBUG_NAME, "profile of %s failed: %s\n",
+                       profile->nick->name, error_message);
+    /* whatever was cached before is still better than nothing */
+    if (profile->show)
+      profile_show(profile->gc, profile, _("User info not available."));
+    profile->show = FALSE;
+    return;
+  }
+
+  if (profile->fields)
+    g_ptr_array_free(profile->fields, TRUE);
+  profile->fields = yggdrasil_parse_profile(body);
+  profile->fetched = time(NULL);
+
+  if (profile->show)
+    profile_show(profile->gc, profile, NULL);
+  profile->show = FALSE;
+}
+
+static void profile_fetch(YggdrasilProfile *profile) {
+  char *escaped, *url;
+
+  if (profile->fetch)
+    return;
+
+  escaped = url_encode(profile->nick->name);
+  url = g_strdup_printf(YGGDRASIL_URL_PROFILE, escaped);
+  profile->fetch = yggdrasil_fetch(url, &yggdrasil_fetch_policy_poll,
+                                   profile_cb, profile);
+  g_free(url);
+  free(escaped);
+}
+
+static gboolean prewarm_cb(gpointer data) {
+  YggdrasilConnection *ya = (YggdrasilConnection *)data;
+  YggdrasilNick *nick = g_queue_pop_head(ya->prewarm);
+  YggdrasilProfile *profile = profile_get(ya, nick, TRUE);
+
+  if (!profile_fresh(profile))
+    profile_fetch(profile);
+  yggdrasil_nick_unref(nick);
+
+  if (g_queue_is_empty(ya->prewarm)) {
+    ya->prewarm_timer = 0;
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* queues who's profile for a background fetch, unless it's cached */
+static void profile_prewarm(YggdrasilConnection *ya, const char *who) {
+  YggdrasilNick *nick = profile_nick(who, TRUE);
+  YggdrasilProfile *profile = profile_get(ya, nick, FALSE);
+
+  if (!nick)
+    return;
+  if (profile && (profile_fresh(profile) || profile->fetch)) {
+    yggdrasil_nick_unref(nick);
+    return;
+  }
+
+  if (!ya->prewarm)
+    ya->prewarm = g_queue_new();
+  if (g_queue_get_length(ya->prewarm) >= YGGDRASIL_PROFILE_PREWARM_MAX ||
+      g_queue_find(ya->prewarm, nick)) {
+    yggdrasil_nick_unref(nick);
+    return;
+  }
+
+  g_queue_push_tail(ya->prewarm, nick);
+  if (!ya->prewarm_timer)
+    ya->prewarm_timer = purple_timeout_add(YGGDRASIL_PROFILE_PREWARM_INTERVAL,
+                                           prewarm_cb, ya);
+}
+
+static void search_tracks_cb(PurpleConnection *gc, const char *words) {
+  track_search(gc->proto_data, words);
+}
+
+static void yggdrasilprpl_search_tracks(PurplePluginAction *action)
+{
+  PurpleConnection *gc = (PurpleConnection *)action->context;
+
+  purple_request_input(gc, _("Track Search"),
+                       _("Search the station's library"),
+                       _("Enter an artist, title or album."),
+                       NULL, FALSE, FALSE, NULL,
+                       _("Search"), G_CALLBACK(search_tracks_cb),
+                       _("Cancel"), NULL,
+                       purple_connection_get_account(gc), NULL, NULL,
+                       gc);
+}
+
 static void yggdrasilprpl_input_user_info(PurplePluginAction *action)
 {
   PurpleConnection *gc = (PurpleConnection *)action->context;
@@ -258,9 +1085,13 @@ static void yggdrasilprpl_input_user_info(PurplePluginAction *action)
  */
 static GList *yggdrasilprpl_actions(PurplePlugin *plugin, gpointer context)
 {
-  PurplePluginAction *action = purple_plugin_action_new(
-    _("Set User Info..."), yggdrasilprpl_input_user_info);
-  return g_list_append(NULL, action);
+  GList *actions = NULL;
+
+  actions = g_list_append(actions, purple_plugin_action_new(
+    _("Set User Info..."), yggdrasilprpl_input_user_info));
+  actions = g_list_append(actions, purple_plugin_action_new(
+    _("Search Tracks..."), yggdrasilprpl_search_tracks));
+  return actions;
 }
 
 
@@ -297,31 +1128,33 @@ static char *yggdrasilprpl_status_text(PurpleBuddy *buddy) {
   }
 }
 
+/* only ever reads the profile cache; a miss queues a background fetch */
 static void yggdrasilprpl_tooltip_text(PurpleBuddy *buddy,
                                   PurpleNotifyUserInfo *info,
                                   gboolean full) {
-  PurpleConnection *gc = get_yggdrasilprpl_gc(buddy->name);
-
-  if (gc) {
-    /* they're logged in */
-    PurplePresence *presence = purple_buddy_get_presence(buddy);
-    PurpleStatus *status = purple_presence_get_active_status(presence);
-    char *msg = yggdrasilprpl_status_text(buddy);
-    purple_notify_user_info_add_pair(info, purple_status_get_name(status),
-                                     msg);
-    g_free(msg);
-
-    if (full) {
-      const char *user_info = purple_account_get_user_info(gc->account);
-      if (user_info)
-        purple_notify_user_info_add_pair(info, _("User info"), user_info);
-    }
+  PurpleConnection *gc = purple_account_get_connection(buddy->account);
+  YggdrasilConnection *ya = gc ? gc->proto_data : NULL;
+  PurplePresence *presence = purple_buddy_get_presence(buddy);
+  PurpleStatus *status = purple_presence_get_active_status(presence);
+  YggdrasilProfile *profile = NULL;
+  char *msg = yggdrasilprpl_status_text(buddy);
+  YggdrasilNick *nick;
+
+  purple_notify_user_info_add_pair(info, purple_status_get_name(status), msg);
+  g_free(msg);
 
-  } else {
-    /* they're not logged in */
-    purple_notify_user_info_add_pair(info, _("User info"), _("not logged in"));
+  if (ya) {
+    nick = profile_nick(buddy->name, FALSE);
+    profile = profile_get(ya, nick, FALSE);
+    if (!profile || !profile_fresh(profile))
+      profile_prewarm(ya, buddy->name);
+    if (nick)
+      yggdrasil_nick_unref(nick);
   }
 
+  if (full && profile && profile->fields)
+    profile_add_pairs(profile, info);
+
   purple_debug_info(PLUGIN_DEBUG_NAME, "showing %s tooltip for %s\n",
                     (full) ? "full" : "short", buddy->name);
 }
@@ -406,110 +1239,250 @@ static GHashTable *yggdrasilprpl_chat_info_defaults(PurpleConnection *gc,
   return defaults;
 }
 
-static void yggdrasilprpl_chat_update_users(PurpleConvChat *chat, const char *account_username){
-  char user[80];
-  FILE *fp;
-  fp = fopen(YGGDRASIL_DATA_USERS, "rt");
-  purple_conv_chat_clear_users(chat);
-  while(fgets(user, 80, fp) != NULL){
-    user[strlen(user)-1] = 0;
-    if( strcmp(user, account_username) != 0 ){
-      purple_conv_chat_add_user(chat, user, "", PURPLE_CBFLAGS_NONE, FALSE);
+/*
+ * brings the chat's user list in line with the roster, adding and removing
+ * only who changed. members holds the nicks the roster has put in the chat.
+ */
+static void yggdrasilprpl_chat_update_users(PurpleConvChat *chat,
+                                           GHashTable *members,
+                                           GPtrArray *users) {
+  GList *joined = NULL, *left = NULL;
+  GList *added = NULL, *flags = NULL, *removed = NULL;
+  GList *l;
+
+  yggdrasil_roster_diff(members, users, &joined, &left);
+
+  for (l = joined; l; l = l->next) {
+    YggdrasilNick *nick = (YggdrasilNick *)l->data;
+    if (!purple_conv_chat_find_user(chat, nick->name)) {
+      added = g_list_prepend(added, nick->name);
+      flags = g_list_prepend(flags, GINT_TO_POINTER(PURPLE_CBFLAGS_NONE));
     }
   }
-  fclose(fp);
+  for (l = left; l; l = l->next)
+    removed = g_list_prepend(removed, ((YggdrasilNick *)l->data)->name);
+
+  if (removed)
+    purple_conv_chat_remove_users(chat, removed, NULL);
+  if (added) {
+    added = g_list_reverse(added);
+    purple_conv_chat_add_users(chat, added, NULL, flags, FALSE);
+  }
+  g_list_free(removed);
+  g_list_free(added);
+  g_list_free(flags);
+  g_list_free(joined);
+  g_list_free_full(left, yggdrasil_nick_unref);
+}
+
+static void yggdrasilprpl_chat_update_topic(PurpleConvChat *chat,
+                                           const char *topic) {
+  purple_conv_chat_set_topic(chat, "system", topic);
 }
 
-static void yggdrasilprpl_chat_update_topic(PurpleConvChat *chat){
-  char topic[4096];
-  FILE *fp;
-  fp = fopen(YGGDRASIL_DATA_TOPIC, "rt");
-  if(fgets(topic, 4096, fp) != NULL){
-    topic[strlen(topic)-1] = 0;
-    purple_conv_chat_set_topic(chat, "system", topic);
+/*
+ * the local history of the intercom, persisted as "mtime<TAB>text" lines in
+ * the purple user dir, so a newly joined chat can be filled in before
+ * chatread.php has answered.
+ */
+static char *history_path(YggdrasilConnection *ya) {
+  char *filename = g_strdup_printf("%s.history",
+      purple_escape_filename(ya->gc->account->username));
+  char *path = g_build_filename(purple_user_dir(), YGGDRASIL_DATA_DIR,
+                                filename, NULL);
+  g_free(filename);
+  return path;
+}
+
+static void history_load(YggdrasilConnection *ya) {
+  char *path = history_path(ya);
+  char *archive_path;
+  gchar *contents;
+  gchar **lines;
+  int i;
+
+  archive_path = g_strdup_printf("%.*s.archive",
+                                 (int)(strlen(path) - strlen(".history")),
+                                 path);
+  ya->archive = yggdrasil_archive_open(archive_path);
+  ya->search = yggdrasil_index_new();
+  yggdrasil_index_build(ya->search, ya->archive);
+  g_free(archive_path);
+
+  ya->history = g_queue_new();
+  if (g_file_get_contents(path, &contents, NULL, NULL)) {
+    lines = g_strsplit(contents, "\n", -1);
+    for (i = 0; lines[i]; i++) {
+      char *text = strchr(lines[i], '\t');
+      if (text && text[1])
+        yggdrasil_history_append(ya->history, text + 1,
+                                 g_ascii_strtoll(lines[i], NULL, 10));
+    }
+    g_strfreev(lines);
+    g_free(contents);
+    /* the privacy settings may have changed since it was saved */
+    yggdrasil_history_filter(ya->history, ya->filter);
   }
-  fclose(fp);
+  g_free(path);
 }
 
-static void yggdrasilprpl_chat_update_convo(PurpleConvChat *chat){
-  char message[4096];
-  int ret;
-  FILE *fp;
+static void history_save(YggdrasilConnection *ya) {
+  char *path = history_path(ya);
+  char *dir = g_path_get_dirname(path);
+  GString *data = g_string_new(NULL);
+  GList *l;
 
-  ret = system("diff /tmp/yggdrasil.chat.log.txt /tmp/yggdrasil.chat.tmp.txt | tail -n +2 | grep '^>' | sed 's/^> //g' > /tmp/yggdrasil.chat.new.txt");
-  fp = fopen(YGGDRASIL_DATA_CHAT_NEW, "rt");
-  while(fgets(message, 4096, fp) != NULL){
-    message[strlen(message)-1] = 0;
-    if(strlen(message) > 0){
-      purple_conv_chat_write(chat, "?", message, PURPLE_MESSAGE_RAW | PURPLE_MESSAGE_NO_LOG | PURPLE_MESSAGE_RECV, time(NULL));
-    }
+  for (l = g_queue_peek_head_link(ya->history); l; l = l->next) {
+    YggdrasilLine *line = (YggdrasilLine *)l->data;
+    g_string_append_printf(data, "%ld\t%s\n", (long)line->mtime, line->text);
   }
-  fclose(fp);
 
-  ret = system("cat /tmp/yggdrasil.chat.new.txt >> /tmp/yggdrasil.chat.log.txt");
-  ret = system("tail -n 99 /tmp/yggdrasil.chat.log.txt > /tmp/yggdrasil.chat.tmp.txt");
-  ret = system("cat /tmp/yggdrasil.chat.tmp.txt > /tmp/yggdrasil.chat.log.txt");
+  if (purple_build_dir(dir, S_IRUSR | S_IWUSR | S_IXUSR) != 0 ||
+      !purple_util_write_data_to_file_absolute(path, data->str, data->len))
+    purple_debug_error(PLUGIN_DEBUG_NAME, "couldn't save history to %s\n",
+                       path);
 
-  if(ret) printf("problem?"); // I don't really care right now.
+  g_string_free(data, TRUE);
+  g_free(dir);
+  g_free(path);
 }
 
-static void yggdrasilprpl_login(PurpleAccount *acct)
-{
-  PurpleConnection *gc = purple_account_get_connection(acct);
-  GList *offline_messages;
-  const char *password;
-  char *login_cmd;
-  char *escaped_username;
-  char *escaped_password;
-  int ret;
-  PurpleChat* pchat;
-  GHashTable *pchat_components;
-  char line[80];
-  FILE *fp;
-  int auth_line = 1;
-
-  purple_debug_info(PLUGIN_DEBUG_NAME, "logging in %s\n", acct->username);
+/* replays the local history into a freshly opened conversation */
+static void history_replay(YggdrasilConnection *ya, PurpleConvChat *chat) {
+  GList *l;
 
-  purple_connection_update_progress(gc, _("Connecting"),
-                                    0,   /* which connection step this is */
-                                    2);  /* total number of steps */
+  for (l = g_queue_peek_head_link(ya->history); l; l = l->next) {
+    YggdrasilLine *line = (YggdrasilLine *)l->data;
+    purple_conv_chat_write(chat, "?", line->text,
+                           PURPLE_MESSAGE_RAW | PURPLE_MESSAGE_NO_LOG |
+                           PURPLE_MESSAGE_RECV | PURPLE_MESSAGE_DELAYED,
+                           line->mtime);
+  }
+}
 
-  ret = system("echo '' > /tmp/yggdrasil.auth.txt");
-  password = purple_account_get_password(acct);
-  escaped_username = url_encode(acct->username);
-  escaped_password = url_encode(password);
-  login_cmd = g_strdup_printf(
-    "curl --silent \"http://yggdrasilradio.net/login.php?uid=%s&pwd=%s\" | sed -e 's/$/\\n/' -e 's/|/\\n/g' > /tmp/yggdrasil.auth.txt"
-    , escaped_username
-    , escaped_password
-  );
-  ret = system(login_cmd);
-  if(ret) printf("problem?\n"); // I don't really care :P
-
-  fp = fopen(YGGDRASIL_DATA_AUTH, "rt");
-  while(fgets(line, 80, fp) != NULL){
-    line[strlen(line)-1] = 0;
-    if(strlen(line) > 0){
-      if(auth_line == 1){
-        strcpy( AUTH_CHAT, line );
-        auth_line = 2;
-      }
-      else if(auth_line == 2){
-        strcpy( AUTH_SEARCH, line );
-        auth_line = 3;
-      }
-      else if(auth_line == 3){
-        strcpy( AUTH_SEARCH_SUBDOMAIN, line );
-        auth_line = -1;
-      }
-    }
+static void yggdrasilprpl_chat_update_convo(PurpleConvChat *chat,
+                                           GPtrArray *window) {
+  PurpleConnection *gc = purple_conversation_get_gc(chat->conv);
+  YggdrasilConnection *ya = gc->proto_data;
+  time_t now = time(NULL);
+  GList *retracted = NULL, *l;
+  gint64 offset;
+  guint i;
+
+  i = yggdrasil_history_delta(ya->history, window, &retracted);
+  if (i == window->len && !retracted)
+    return;  /* nothing new */
+  YGGDRASIL_METRIC(YGGDRASIL_METRIC_MESSAGES, window->len - i);
+
+  /* lines taken back with /undo. a conversation can't lose a line, so it
+   * is told instead; the archive keeps what was read. */
+  for (l = retracted; l; l = l->next) {
+    YggdrasilLine *line = (YggdrasilLine *)l->data;
+    char *msg = g_strdup_printf(_("Undone: %s"), line->text);
+    purple_conv_chat_write(chat, "", msg,
+                           PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_NO_LOG, now);
+    g_free(msg);
+  }
+  g_list_free_full(retracted, yggdrasil_line_free);
+
+  for (; i < window->len; i++) {
+    const char *message = g_ptr_array_index(window, i);
+    /* what we said was shown when we said it */
+    if (!yggdrasil_echo_match(ya->echoes, message))
+      purple_conv_chat_write(chat, "?", message, PURPLE_MESSAGE_RAW | PURPLE_MESSAGE_NO_LOG | PURPLE_MESSAGE_RECV, now);
+    yggdrasil_history_append(ya->history, message, now);
+    offset = yggdrasil_archive_append(ya->archive, now, message);
+    if (yggdrasil_index_built(ya->search))
+      yggdrasil_index_add(ya->search, offset, message, strlen(message));
   }
-  fclose(fp);
+
+  history_save(ya);
+}
+
+/* replaces the connection's tokens with login.php's answer, if it has them */
+static gboolean parse_auth(YggdrasilConnection *ya, const char *body) {
+  char *chat, *search, *subdomain;
+
+  if (!yggdrasil_parse_auth(body, &chat, &search, &subdomain))
+    return FALSE;
+
+  g_free(ya->auth_chat);
+  g_free(ya->auth_search);
+  g_free(ya->auth_search_subdomain);
+  ya->auth_chat = chat;
+  ya->auth_search = search;
+  ya->auth_search_subdomain = subdomain;
+  return TRUE;
+}
+
+/*
+ * the tokens are kept in the account's settings, next to the password
+ * purple already stores there, so startup can skip the login round trip.
+ */
+static void auth_cache_store(YggdrasilConnection *ya) {
+  PurpleAccount *acct = purple_connection_get_account(ya->gc);
+
+  purple_account_set_string(acct, YGGDRASIL_SETTING_AUTH_CHAT, ya->auth_chat);
+  purple_account_set_string(acct, YGGDRASIL_SETTING_AUTH_SEARCH,
+                            ya->auth_search);
+  purple_account_set_string(acct, YGGDRASIL_SETTING_AUTH_SEARCH_SUBDOMAIN,
+                            ya->auth_search_subdomain);
+  purple_account_set_int(acct, YGGDRASIL_SETTING_AUTH_EXPIRES,
+                         time(NULL) + YGGDRASIL_AUTH_CACHE_TTL);
+}
+
+static void auth_cache_clear(PurpleAccount *acct) {
+  purple_account_set_string(acct, YGGDRASIL_SETTING_AUTH_CHAT, NULL);
+  purple_account_set_string(acct, YGGDRASIL_SETTING_AUTH_SEARCH, NULL);
+  purple_account_set_string(acct, YGGDRASIL_SETTING_AUTH_SEARCH_SUBDOMAIN, NULL);
+  purple_account_set_int(acct, YGGDRASIL_SETTING_AUTH_EXPIRES, 0);
+}
+
+/* loads unexpired cached tokens into ya. returns FALSE if there are none. */
+static gboolean auth_cache_load(YggdrasilConnection *ya) {
+  PurpleAccount *acct = purple_connection_get_account(ya->gc);
+  const char *chat, *search, *subdomain;
+  time_t expires;
+
+  expires = purple_account_get_int(acct, YGGDRASIL_SETTING_AUTH_EXPIRES, 0);
+  chat = purple_account_get_string(acct, YGGDRASIL_SETTING_AUTH_CHAT, NULL);
+  search = purple_account_get_string(acct, YGGDRASIL_SETTING_AUTH_SEARCH, NULL);
+  subdomain = purple_account_get_string(acct,
+                                        YGGDRASIL_SETTING_AUTH_SEARCH_SUBDOMAIN,
+                                        NULL);
+
+  if (expires <= time(NULL) || !chat || !*chat || !search || !*search ||
+      !subdomain || !*subdomain)
+    return FALSE;
+
+  ya->auth_chat = g_strdup(chat);
+  ya->auth_search = g_strdup(search);
+  ya->auth_search_subdomain = g_strdup(subdomain);
+  return TRUE;
+}
+
+static void login_start(YggdrasilConnection *ya);
+
+static void login_finish(PurpleConnection *gc) {
+  PurpleAccount *acct = purple_connection_get_account(gc);
+  YggdrasilConnection *ya = gc->proto_data;
+  GList *offline_messages;
+  PurpleChat* pchat;
+  GHashTable *pchat_components;
 
   purple_connection_update_progress(gc, _("Connected"),
                                     1,   /* which connection step this is */
                                     2);  /* total number of steps */
   purple_connection_set_state(gc, PURPLE_CONNECTED);
+  registry_add_gc(gc);
+
+  /* have a connection ready for the first track search */
+  if (ya->auth_search_subdomain && *ya->auth_search_subdomain) {
+    char *url = g_strdup_printf(YGGDRASIL_URL_SEARCH_HOME,
+                                ya->auth_search_subdomain);
+    yggdrasil_fetch_prewarm(url);
+    g_free(url);
+  }
 
   pchat = purple_blist_find_chat(acct, "Yggdrasil Intercom");
   if(pchat != NULL){
@@ -523,34 +1496,226 @@ static void yggdrasilprpl_login(PurpleAccount *acct)
   /* tell purple about everyone on our buddy list who's connected */
   foreach_yggdrasilprpl_gc(discover_status, gc, NULL);
 
-  /* notify other yggdrasilprpl accounts */
-  foreach_yggdrasilprpl_gc(report_status_change, gc, NULL);
+  /* notify other yggdrasilprpl accounts */
+  foreach_yggdrasilprpl_gc(report_status_change, gc, NULL);
+
+  /* fetch stored offline messages */
+  purple_debug_info(PLUGIN_DEBUG_NAME, "checking for offline messages for %s\n",
+                    acct->username);
+  offline_messages = g_hash_table_lookup(goffline_messages, acct->username);
+  while (offline_messages) {
+    GOfflineMessage *message = (GOfflineMessage *)offline_messages->data;
+    purple_debug_info(PLUGIN_DEBUG_NAME, "delivering offline message to %s: %s\n",
+                      acct->username, message->message);
+    serv_got_im(gc, message->from, message->message, message->flags,
+                message->mtime);
+    offline_messages = g_list_next(offline_messages);
+
+    g_free(message->from);
+    g_free(message->message);
+    g_free(message);
+  }
+
+  g_list_free(offline_messages);
+  g_hash_table_remove(goffline_messages, &acct->username);
+}
+
+/*
+ * handles both the initial login and the re-login that follows a rejected
+ * chatwrite.php, in which case the connection is already up.
+ */
+static void login_cb(YggdrasilFetch *fetch, gpointer userdata,
+                     const char *body, gsize len, const char *error_message) {
+  PurpleConnection *gc = (PurpleConnection *)userdata;
+  YggdrasilConnection *ya = gc->proto_data;
+  GList *l;
+
+  ya->login_fetch = NULL;
+  YGGDRASIL_METRIC_SINCE(YGGDRASIL_METRIC_LOGIN_SECONDS, ya->login_at);
+  if (error_message)
+    YGGDRASIL_METRIC(YGGDRASIL_METRIC_LOGIN_FAILURES, 1);
+
+  if (error_message && purple_connection_get_state(gc) == PURPLE_CONNECTED) {
+    /* a failed re-login drops the parked writes, not the connection */
+    purple_debug_error(PLUGIN_DEBUG_NAME, "re-login failed: %s\n",
+                       error_message);
+    purple_notify_info(gc, _("Alert"), _("Alert"), _("chatwrite failed."));
+    for (l = ya->writes; l; ) {
+      YggdrasilWrite *write = (YggdrasilWrite *)l->data;
+      l = l->next;
+      if (!write->fetch)
+        write_fail(write);
+    }
+    outbox_flush(ya);
+    return;
+  }
+
+  if (error_message) {
+    char *msg = g_strdup_printf(_("Unable to reach %s: %s"),
+                                YGGDRASIL_NETWORK, error_message);
+    purple_debug_error(PLUGIN_DEBUG_NAME, "login failed: %s\n", error_message);
+    purple_connection_error_reason(gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
+                                   msg);
+    g_free(msg);
+    return;
+  }
+
+  if (!parse_auth(ya, body)) {
+    purple_debug_error(PLUGIN_DEBUG_NAME, "login rejected: %s\n", body);
+    YGGDRASIL_METRIC(YGGDRASIL_METRIC_LOGIN_FAILURES, 1);
+    purple_connection_error_reason(gc,
+                                   PURPLE_CONNECTION_ERROR_AUTHENTICATION_FAILED,
+                                   _("Incorrect username or password"));
+    return;
+  }
+
+  auth_cache_store(ya);
+
+  if (purple_connection_get_state(gc) != PURPLE_CONNECTED) {
+    login_finish(gc);
+    return;
+  }
+
+  /* re-login: resend the writes that were parked waiting for a token */
+  for (l = ya->writes; l; l = l->next) {
+    YggdrasilWrite *write = (YggdrasilWrite *)l->data;
+    if (!write->fetch)
+      write_send(write);
+  }
+}
+
+static void login_start(YggdrasilConnection *ya) {
+  PurpleAccount *acct = purple_connection_get_account(ya->gc);
+  const char *password = purple_account_get_password(acct);
+  char *login_url;
+  char *escaped_username;
+  char *escaped_password;
+
+  escaped_username = url_encode(acct->username);
+  escaped_password = url_encode(password ? password : "");
+  login_url = g_strdup_printf(YGGDRASIL_URL_LOGIN,
+                              escaped_username, escaped_password);
+  ya->login_fetch = yggdrasil_fetch(login_url, &yggdrasil_fetch_policy_login,
+                                    login_cb, ya->gc);
+  ya->login_at = YGGDRASIL_METRIC_NOW();
+  YGGDRASIL_METRIC(YGGDRASIL_METRIC_LOGINS, 1);
+
+  g_free(login_url);
+  free(escaped_username);
+  free(escaped_password);
+}
+
+static void yggdrasilprpl_start(void);
+static void filter_update(YggdrasilConnection *ya, GList *leaving);
+
+static void yggdrasilprpl_login(PurpleAccount *acct)
+{
+  PurpleConnection *gc = purple_account_get_connection(acct);
+  YggdrasilConnection *ya;
+
+  purple_debug_info(PLUGIN_DEBUG_NAME, "logging in %s\n", acct->username);
+  yggdrasilprpl_start();
+  YGGDRASIL_STAGE_ENTER(YGGDRASIL_STAGE_LOGIN);
+
+  ya = g_new0(YggdrasilConnection, 1);
+  ya->gc = gc;
+  ya->outbox = g_queue_new();
+  ya->window = g_ptr_array_new();
+  ya->roster = g_ptr_array_new();
+  ya->members = yggdrasil_members_new();
+  ya->echoes = g_queue_new();
+  ya->played = g_queue_new();
+  filter_update(ya, NULL);
+  ya->send_tokens = purple_account_get_int(acct, YGGDRASIL_SETTING_SEND_BURST,
+                                           YGGDRASIL_SEND_BURST);
+  ya->send_tokens_at = g_get_monotonic_time();
+  gc->proto_data = ya;
 
-  /* fetch stored offline messages */
-  purple_debug_info(PLUGIN_DEBUG_NAME, "checking for offline messages for %s\n",
-                    acct->username);
-  offline_messages = g_hash_table_lookup(goffline_messages, acct->username);
-  while (offline_messages) {
-    GOfflineMessage *message = (GOfflineMessage *)offline_messages->data;
-    purple_debug_info(PLUGIN_DEBUG_NAME, "delivering offline message to %s: %s\n",
-                      acct->username, message->message);
-    serv_got_im(gc, message->from, message->message, message->flags,
-                message->mtime);
-    offline_messages = g_list_next(offline_messages);
+  purple_connection_update_progress(gc, _("Connecting"),
+                                    0,   /* which connection step this is */
+                                    2);  /* total number of steps */
 
-    g_free(message->from);
-    g_free(message->message);
-    g_free(message);
+  /* optimistically reuse cached tokens; a rejected chatwrite.php will
+   * trigger a fresh login */
+  if (auth_cache_load(ya)) {
+    purple_debug_info(PLUGIN_DEBUG_NAME, "reusing cached tokens for %s\n",
+                      acct->username);
+    /* nothing has connected to the station yet; do so before the first
+     * chatread needs it */
+    yggdrasil_fetch_prewarm(YGGDRASIL_URL_HOME);
+    login_finish(gc);
+    YGGDRASIL_STAGE_LEAVE(YGGDRASIL_STAGE_LOGIN);
+    return;
   }
 
-  g_list_free(offline_messages);
-  g_hash_table_remove(goffline_messages, &acct->username);
+  login_start(ya);
+  YGGDRASIL_STAGE_LEAVE(YGGDRASIL_STAGE_LOGIN);
 }
 
+static void stop_polling(YggdrasilConnection *ya);
+static void roomlist_done(YggdrasilConnection *ya);
+
 static void yggdrasilprpl_close(PurpleConnection *gc)
 {
+  YggdrasilConnection *ya = gc->proto_data;
+
   /* notify other yggdrasilprpl accounts */
   foreach_yggdrasilprpl_gc(report_status_change, gc, NULL);
+  registry_remove_gc(gc);
+
+  if (ya) {
+    /* cancels a login that is still in flight */
+    if (ya->login_fetch)
+      yggdrasil_fetch_cancel(ya->login_fetch);
+    while (ya->writes) {
+      YggdrasilWrite *write = (YggdrasilWrite *)ya->writes->data;
+      if (write->fetch)
+        yggdrasil_fetch_cancel(write->fetch);
+      g_free(write->message);
+      g_free(write);
+      ya->writes = g_list_delete_link(ya->writes, ya->writes);
+    }
+    if (ya->send_timer)
+      purple_timeout_remove(ya->send_timer);
+    if (ya->outbox) {
+      while (!g_queue_is_empty(ya->outbox))
+        write_free(g_queue_pop_head(ya->outbox));
+      g_queue_free(ya->outbox);
+    }
+    stop_polling(ya);
+    yggdrasil_arena_clear(&ya->arena);
+    g_ptr_array_free(ya->window, TRUE);
+    g_ptr_array_free(ya->roster, TRUE);
+    g_hash_table_destroy(ya->members);
+    yggdrasil_filter_free(ya->filter);
+    g_free(ya->topic);
+    g_queue_free_full(ya->played, yggdrasil_now_playing_free);
+    if (ya->history)
+      g_queue_free_full(ya->history, yggdrasil_line_free);
+    g_queue_free_full(ya->echoes, yggdrasil_echo_free);
+    if (ya->search)
+      yggdrasil_index_free(ya->search);
+    if (ya->archive)
+      yggdrasil_archive_close(ya->archive);
+    if (ya->track_fetch)
+      yggdrasil_fetch_cancel(ya->track_fetch);
+    g_free(ya->track_query);
+    track_cache_clear(&ya->tracks);
+    roomlist_done(ya);
+    if (ya->prewarm_timer)
+      purple_timeout_remove(ya->prewarm_timer);
+    if (ya->prewarm)
+      g_queue_free_full(ya->prewarm, yggdrasil_nick_unref);
+    if (ya->profiles) {
+      g_queue_free(ya->profile_lru);
+      g_hash_table_destroy(ya->profiles);
+    }
+    g_free(ya->auth_chat);
+    g_free(ya->auth_search);
+    g_free(ya->auth_search_subdomain);
+    g_free(ya);
+    gc->proto_data = NULL;
+  }
 }
 
 static int yggdrasilprpl_send_im(PurpleConnection *gc, const char *who,
@@ -630,35 +1795,6 @@ static void notify_typing(PurpleConnection *from, PurpleConnection *to,
                   (PurpleTypingState)typing);
 }
 
-/* Converts a hex character to its integer value */
-char from_hex(char ch) {
-  return isdigit(ch) ? ch - '0' : tolower(ch) - 'a' + 10;
-}
-
-/* Converts an integer value to its hex character*/
-char to_hex(char code) {
-  static char hex[] = "0123456789abcdef";
-  return hex[code & 15];
-}
-
-/* Returns a url-encoded version of str */
-/* IMPORTANT: be sure to free() the returned string after use */
-char *url_encode(const char *str) {
-  const char *pstr = str;
-  char *buf = malloc(strlen(str) * 3 + 1), *pbuf = buf;
-  while (*pstr) {
-    if (isalnum(*pstr) || *pstr == '-' || *pstr == '_' || *pstr == '.' || *pstr == '~')
-      *pbuf++ = *pstr;
-    else if (*pstr == ' ')
-      *pbuf++ = '+';
-    else
-      *pbuf++ = '%', *pbuf++ = to_hex(*pstr >> 4), *pbuf++ = to_hex(*pstr & 15);
-    pstr++;
-  }
-  *pbuf = '\0';
-  return buf;
-}
-
 static unsigned int yggdrasilprpl_send_typing(PurpleConnection *gc, const char *name,
                                          PurpleTypingState typing) {
   purple_debug_info(PLUGIN_DEBUG_NAME, "%s %s\n", gc->account->username,
@@ -668,47 +1804,55 @@ static unsigned int yggdrasilprpl_send_typing(PurpleConnection *gc, const char *
 }
 
 static void yggdrasilprpl_get_info(PurpleConnection *gc, const char *username) {
-  const char *body;
-  PurpleNotifyUserInfo *info = purple_notify_user_info_new();
-  PurpleAccount *acct;
+  YggdrasilConnection *ya = gc->proto_data;
+  YggdrasilNick *nick = profile_nick(username, TRUE);
+  YggdrasilProfile *profile;
 
-  purple_debug_info(PLUGIN_DEBUG_NAME, "Fetching %s's user info for %s\n", username,
-                    gc->account->username);
-
-  if (!get_yggdrasilprpl_gc(username)) {
-    char *msg = g_strdup_printf(_("%s is not logged in."), username);
-    purple_notify_error(gc, _("User Info"), _("User info not available. "), msg);
-    g_free(msg);
+  if (!nick)
+    return;
+  YGGDRASIL_STAGE_ENTER(YGGDRASIL_STAGE_GET_INFO);
+  profile = profile_get(ya, nick, TRUE);
+  yggdrasil_nick_unref(nick);
+  purple_debug_info(PLUGIN_DEBUG_NAME, "Fetching %s's user info for %s\n",
+                    profile->nick->name, gc->account->username);
+
+  if (profile_fresh(profile)) {
+    profile_show(gc, profile, NULL);
+    YGGDRASIL_STAGE_LEAVE(YGGDRASIL_STAGE_GET_INFO);
+    return;
   }
 
-  acct = purple_accounts_find(username, YGGDRASILPRPL_ID);
-  if (acct)
-    body = purple_account_get_user_info(acct);
-  else
-    body = _("No user info.");
-  purple_notify_user_info_add_pair(info, "Info", body);
-
-  /* show a buddy's user info in a nice dialog box */
-  purple_notify_userinfo(gc,        /* connection the buddy info came through */
-                         username,  /* buddy's username */
-                         info,      /* body */
-                         NULL,      /* callback called when dialog closed */
-                         NULL);     /* userdata for callback */
+  /* show what we have now; the dialog is filled in when the answer comes */
+  profile_show(gc, profile, _("Fetching user info..."));
+  profile->show = TRUE;
+  profile_fetch(profile);
+  YGGDRASIL_STAGE_LEAVE(YGGDRASIL_STAGE_GET_INFO);
 }
 
 static void yggdrasilprpl_set_status(PurpleAccount *acct, PurpleStatus *status) {
   const char *msg = purple_status_get_attr_string(status, "message");
+  PurpleConnection *gc;
   purple_debug_info(PLUGIN_DEBUG_NAME, "setting %s's status to %s: %s\n",
                     acct->username, purple_status_get_name(status), msg);
 
   foreach_yggdrasilprpl_gc(report_status_change, get_yggdrasilprpl_gc(acct->username),
                       NULL);
+
+  /* slow down while away, catch up on coming back */
+  gc = purple_account_get_connection(acct);
+  if (gc && gc->proto_data)
+    poll_schedule(gc->proto_data);
 }
 
 static void yggdrasilprpl_set_idle(PurpleConnection *gc, int idletime) {
+  YggdrasilConnection *ya = gc->proto_data;
+
   purple_debug_info(PLUGIN_DEBUG_NAME,
                     "purple reports that %s has been idle for %d seconds\n",
                     gc->account->username, idletime);
+
+  ya->idle = idletime > 0;
+  poll_schedule(ya);
 }
 
 static void yggdrasilprpl_change_passwd(PurpleConnection *gc, const char *old_pass,
@@ -717,8 +1861,16 @@ static void yggdrasilprpl_change_passwd(PurpleConnection *gc, const char *old_pa
                     gc->account->username);
 }
 
-static void yggdrasilprpl_add_buddy(PurpleConnection *gc, PurpleBuddy *buddy,
-                               PurpleGroup *group)
+/* under PURPLE_PRIVACY_ALLOW_BUDDYLIST the buddy list is the permit list.
+ * purple calls remove_buddy(ies) before taking them off the list, so those
+ * are passed as leaving. */
+static void filter_buddies_changed(PurpleConnection *gc, GList *leaving) {
+  if (gc->proto_data &&
+      gc->account->perm_deny == PURPLE_PRIVACY_ALLOW_BUDDYLIST)
+    filter_update(gc->proto_data, leaving);
+}
+
+static void buddy_added(PurpleConnection *gc, PurpleBuddy *buddy)
 {
   const char *username = gc->account->username;
   PurpleConnection *buddy_gc = get_yggdrasilprpl_gc(buddy->name);
@@ -746,6 +1898,13 @@ static void yggdrasilprpl_add_buddy(PurpleConnection *gc, PurpleBuddy *buddy,
   }
 }
 
+static void yggdrasilprpl_add_buddy(PurpleConnection *gc, PurpleBuddy *buddy,
+                               PurpleGroup *group)
+{
+  buddy_added(gc, buddy);
+  filter_buddies_changed(gc, NULL);
+}
+
 static void yggdrasilprpl_add_buddies(PurpleConnection *gc, GList *buddies,
                                  GList *groups) {
   GList *buddy = buddies;
@@ -754,17 +1913,22 @@ static void yggdrasilprpl_add_buddies(PurpleConnection *gc, GList *buddies,
   purple_debug_info(PLUGIN_DEBUG_NAME, "adding multiple buddies\n");
 
   while (buddy && group) {
-    yggdrasilprpl_add_buddy(gc, (PurpleBuddy *)buddy->data, (PurpleGroup *)group->data);
+    buddy_added(gc, (PurpleBuddy *)buddy->data);
     buddy = g_list_next(buddy);
     group = g_list_next(group);
   }
+  filter_buddies_changed(gc, NULL);
 }
 
 static void yggdrasilprpl_remove_buddy(PurpleConnection *gc, PurpleBuddy *buddy,
                                   PurpleGroup *group)
 {
+  GList *leaving = g_list_prepend(NULL, buddy);
+
   purple_debug_info(PLUGIN_DEBUG_NAME, "removing %s from %s's buddy list\n",
                     buddy->name, gc->account->username);
+  filter_buddies_changed(gc, leaving);
+  g_list_free(leaving);
 }
 
 static void yggdrasilprpl_remove_buddies(PurpleConnection *gc, GList *buddies,
@@ -775,11 +1939,13 @@ static void yggdrasilprpl_remove_buddies(PurpleConnection *gc, GList *buddies,
   purple_debug_info(PLUGIN_DEBUG_NAME, "removing multiple buddies\n");
 
   while (buddy && group) {
-    yggdrasilprpl_remove_buddy(gc, (PurpleBuddy *)buddy->data,
-                          (PurpleGroup *)group->data);
+    purple_debug_info(PLUGIN_DEBUG_NAME, "removing %s from %s's buddy list\n",
+                      ((PurpleBuddy *)buddy->data)->name,
+                      gc->account->username);
     buddy = g_list_next(buddy);
     group = g_list_next(group);
   }
+  filter_buddies_changed(gc, buddies);
 }
 
 /*
@@ -787,31 +1953,101 @@ static void yggdrasilprpl_remove_buddies(PurpleConnection *gc, GList *buddies,
  * its authoritative privacy settings, and uses purple's logic (specifically
  * purple_privacy_check(), from privacy.h), to determine whether messages are
  * allowed or blocked.
+ *
+ * in the intercom, they're applied by a YggdrasilFilter in the chatread
+ * parsers. filter_update rebuilds it on every change to the privacy settings
+ * (or to the buddy list, when that is the permit list; leaving are buddies
+ * on their way off it) and applies it to what is already shown: the lines it drops leave the history, and the listeners
+ * it drops leave the user list. those it lets back in come with the next
+ * poll; nothing is fetched again.
  */
+static void filter_update(YggdrasilConnection *ya, GList *leaving) {
+  PurpleAccount *acct = purple_connection_get_account(ya->gc);
+  PurpleConvChat *chat = yggdrasil_chat(ya);
+  YggdrasilFilter *filter = NULL;
+  GHashTableIter iter;
+  gpointer key;
+  GSList *buddies, *l;
+
+  switch (acct->perm_deny) {
+  case PURPLE_PRIVACY_DENY_USERS:
+    filter = yggdrasil_filter_new(FALSE);
+    for (l = acct->deny; l; l = l->next)
+      yggdrasil_filter_add(filter, l->data);
+    break;
+  case PURPLE_PRIVACY_ALLOW_USERS:
+    filter = yggdrasil_filter_new(TRUE);
+    for (l = acct->permit; l; l = l->next)
+      yggdrasil_filter_add(filter, l->data);
+    break;
+  case PURPLE_PRIVACY_ALLOW_BUDDYLIST:
+    filter = yggdrasil_filter_new(TRUE);
+    buddies = purple_find_buddies(acct, NULL);
+    for (l = buddies; l; l = l->next)
+      if (!g_list_find(leaving, l->data))
+        yggdrasil_filter_add(filter,
+                             purple_buddy_get_name((PurpleBuddy *)l->data));
+    g_slist_free(buddies);
+    break;
+  case PURPLE_PRIVACY_DENY_ALL:
+    filter = yggdrasil_filter_new(TRUE);
+    break;
+  default:  /* PURPLE_PRIVACY_ALLOW_ALL */
+    break;
+  }
+  /* what we say ourselves is always shown */
+  if (filter && filter->permit)
+    yggdrasil_filter_add(filter, acct->username);
+
+  yggdrasil_filter_free(ya->filter);
+  ya->filter = filter;
+  if (!filter)
+    return;
+
+  if (ya->history && yggdrasil_history_filter(ya->history, filter))
+    history_save(ya);
+
+  g_hash_table_iter_init(&iter, ya->members);
+  while (g_hash_table_iter_next(&iter, &key, NULL)) {
+    const char *name = ((YggdrasilNick *)key)->name;
+    const char *at = strstr(name, " @ ");
+
+    if (yggdrasil_filter_allows(filter, name,
+                                at ? (gsize)(at - name) : strlen(name)))
+      continue;
+    if (chat)
+      purple_conv_chat_remove_user(chat, name, NULL);
+    g_hash_table_iter_remove(&iter);
+  }
+}
+
 static void yggdrasilprpl_add_permit(PurpleConnection *gc, const char *name) {
   purple_debug_info(PLUGIN_DEBUG_NAME, "%s adds %s to their allowed list\n",
                     gc->account->username, name);
+  filter_update(gc->proto_data, NULL);
 }
 
 static void yggdrasilprpl_add_deny(PurpleConnection *gc, const char *name) {
   purple_debug_info(PLUGIN_DEBUG_NAME, "%s adds %s to their blocked list\n",
                     gc->account->username, name);
+  filter_update(gc->proto_data, NULL);
 }
 
 static void yggdrasilprpl_rem_permit(PurpleConnection *gc, const char *name) {
   purple_debug_info(PLUGIN_DEBUG_NAME, "%s removes %s from their allowed list\n",
                     gc->account->username, name);
+  filter_update(gc->proto_data, NULL);
 }
 
 static void yggdrasilprpl_rem_deny(PurpleConnection *gc, const char *name) {
   purple_debug_info(PLUGIN_DEBUG_NAME, "%s removes %s from their blocked list\n",
                     gc->account->username, name);
+  filter_update(gc->proto_data, NULL);
 }
 
 static void yggdrasilprpl_set_permit_deny(PurpleConnection *gc) {
-  /* this is for synchronizing the local black/whitelist with the server.
-   * for yggdrasilprpl, it's a noop.
-   */
+  /* there's no server list to synchronize with, only the local filter */
+  filter_update(gc->proto_data, NULL);
 }
 
 static void joined_chat(PurpleConvChat *from, PurpleConvChat *to,
@@ -839,6 +2075,7 @@ static void joined_chat(PurpleConvChat *from, PurpleConvChat *to,
 }
 
 static void yggdrasilprpl_join_chat(PurpleConnection *gc, GHashTable *components) {
+  YggdrasilConnection *ya = gc->proto_data;
   PurpleConversation *conv;
   PurpleConvChat* chat;
   const char *username = gc->account->username;
@@ -846,30 +2083,32 @@ static void yggdrasilprpl_join_chat(PurpleConnection *gc, GHashTable *components
   int chat_id = g_str_hash(room);
   purple_debug_info(PLUGIN_DEBUG_NAME, "%s is joining chat room %s\n", username, room);
 
+  YGGDRASIL_STAGE_ENTER(YGGDRASIL_STAGE_JOIN);
+  if (!ya->history)
+    history_load(ya);
+
   conv = purple_find_chat(gc, chat_id);
   if (!conv) {
-    serv_got_joined_chat(gc, chat_id, room);
+    conv = serv_got_joined_chat(gc, chat_id, room);
+    registry_join(conv);
 
     /* tell everyone that we joined, and add them if they're already there */
     foreach_gc_in_chat(joined_chat, gc, chat_id, NULL);
 
-    conv = purple_find_chat(gc, chat_id);
+    /* fill the window in from the local history right away; chatread.php
+     * then only adds what's new since */
+    chat = purple_conversation_get_chat_data(conv);
+    history_replay(ya, chat);
   } else {
     purple_debug_info(PLUGIN_DEBUG_NAME, "%s is already in chat room %s\n", username,
                       room);
   }
-  chatread(); // Update from website.
-
-  chat = purple_conversation_get_chat_data(conv);
-  yggdrasilprpl_chat_update_users(chat, username);
-  yggdrasilprpl_chat_update_topic(chat);
-  yggdrasilprpl_chat_update_convo(chat);
 
-  current_conv = conv;
-  current_chat = chat;
-  signal(SIGALRM, SIG_IGN);
-  signal(SIGALRM, refresh);
-  alarm(YGGDRASIL_REFRESH_CHAT_INTERVAL);
+  ya->chat_id = chat_id;
+  ya->poll_mode = YGGDRASIL_POLL_ACTIVE;
+  chatread(ya, YGGDRASIL_CHATREAD_LINES); // Update from website.
+  poll_schedule(ya);
+  YGGDRASIL_STAGE_LEAVE(YGGDRASIL_STAGE_JOIN);
 }
 
 static void yggdrasilprpl_reject_chat(PurpleConnection *gc, GHashTable *components) {
@@ -942,6 +2181,26 @@ static void left_chat_room(PurpleConvChat *from, PurpleConvChat *to,
   }
 }
 
+static void stop_polling(YggdrasilConnection *ya) {
+  ya->chat_id = 0;
+  if (ya->poll_timer) {
+    purple_timeout_remove(ya->poll_timer);
+    ya->poll_timer = 0;
+  }
+  if (ya->chat_fetch) {
+    yggdrasil_fetch_cancel(ya->chat_fetch);
+    ya->chat_fetch = NULL;
+  }
+  if (ya->status_fetch) {
+    yggdrasil_fetch_cancel(ya->status_fetch);
+    ya->status_fetch = NULL;
+  }
+  /* purple empties the user list of a chat that's left, and its topic */
+  g_hash_table_remove_all(ya->members);
+  g_free(ya->topic);
+  ya->topic = NULL;
+}
+
 static void yggdrasilprpl_chat_leave(PurpleConnection *gc, int id) {
   PurpleConversation *conv = purple_find_chat(gc, id);
   purple_debug_info(PLUGIN_DEBUG_NAME, "%s is leaving chat room %s\n",
@@ -949,6 +2208,147 @@ static void yggdrasilprpl_chat_leave(PurpleConnection *gc, int id) {
 
   /* tell everyone that we left */
   foreach_gc_in_chat(left_chat_room, gc, id, NULL);
+  registry_leave(conv);
+
+  stop_polling(gc->proto_data);
+}
+
+static void show_archived_line(time_t mtime, const char *text,
+                               gpointer userdata) {
+  purple_conv_chat_write((PurpleConvChat *)userdata, "?", text,
+                         PURPLE_MESSAGE_RAW | PURPLE_MESSAGE_NO_LOG |
+                         PURPLE_MESSAGE_RECV | PURPLE_MESSAGE_DELAYED, mtime);
+}
+
+/* /archive [hours ago] [hours]: replays a stretch of the archive */
+static PurpleCmdRet show_archive(PurpleConversation *conv, const gchar *cmd,
+                                 gchar **args, gchar **error, void *userdata) {
+  YggdrasilConnection *ya = purple_conversation_get_gc(conv)->proto_data;
+  PurpleConvChat *chat = purple_conversation_get_chat_data(conv);
+  int ago = (args[0] && *args[0]) ? atoi(args[0]) : 24;
+  int span = (args[0] && args[1] && *args[1]) ? atoi(args[1]) : 1;
+  time_t from = time(NULL) - ago * 3600;
+  char *msg;
+  int found;
+
+  if (ago <= 0 || span <= 0) {
+    *error = g_strdup(_("Usage: archive [hours ago] [hours]"));
+    return PURPLE_CMD_RET_FAILED;
+  }
+  if (!ya || !ya->archive) {
+    *error = g_strdup(_("The archive isn't open yet."));
+    return PURPLE_CMD_RET_FAILED;
+  }
+
+  found = yggdrasil_archive_query(ya->archive, from, from + span * 3600,
+                                  YGGDRASIL_ARCHIVE_SHOW_MAX,
+                                  show_archived_line, chat);
+
+  msg = g_strdup_printf(_("%d archived line(s) from %d to %d hour(s) ago."),
+                        found, ago, ago - span);
+  purple_conv_chat_write(chat, "", msg,
+                         PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_NO_LOG,
+                         time(NULL));
+  g_free(msg);
+  return PURPLE_CMD_RET_OK;
+}
+
+/* /played [count]: lists the latest tracks named in the topic */
+static PurpleCmdRet show_played(PurpleConversation *conv, const gchar *cmd,
+                                gchar **args, gchar **error, void *userdata) {
+  YggdrasilConnection *ya = purple_conversation_get_gc(conv)->proto_data;
+  PurpleConvChat *chat = purple_conversation_get_chat_data(conv);
+  int count = (args[0] && *args[0]) ? atoi(args[0]) : YGGDRASIL_PLAYED_SHOW;
+  GList *l;
+  int skip;
+
+  if (count <= 0) {
+    *error = g_strdup(_("Usage: played [count]"));
+    return PURPLE_CMD_RET_FAILED;
+  }
+  if (!ya || g_queue_is_empty(ya->played)) {
+    *error = g_strdup(_("No tracks have been played yet."));
+    return PURPLE_CMD_RET_FAILED;
+  }
+
+  /* the latest count, oldest first */
+  skip = (int)g_queue_get_length(ya->played) - count;
+  for (l = g_queue_peek_head_link(ya->played); l; l = l->next) {
+    YggdrasilNowPlaying *np = (YggdrasilNowPlaying *)l->data;
+    char *track, *msg;
+
+    if (skip-- > 0)
+      continue;
+    track = yggdrasil_now_playing_describe(np);
+    msg = g_strdup_printf("%s %s",
+                          purple_utf8_strftime("%H:%M",
+                                               localtime(&np->started)),
+                          track);
+    purple_conv_chat_write(chat, "", msg,
+                           PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_NO_LOG,
+                           time(NULL));
+    g_free(msg);
+    g_free(track);
+  }
+  return PURPLE_CMD_RET_OK;
+}
+
+/* /search <words>: finds archived lines containing all of the words */
+static PurpleCmdRet search_archive(PurpleConversation *conv, const gchar *cmd,
+                                   gchar **args, gchar **error,
+                                   void *userdata) {
+  YggdrasilConnection *ya = purple_conversation_get_gc(conv)->proto_data;
+  PurpleConvChat *chat = purple_conversation_get_chat_data(conv);
+  GArray *matches;
+  guint shown;
+  char *msg;
+
+  if (!args[0] || !*args[0]) {
+    *error = g_strdup(_("Usage: search &lt;words&gt;"));
+    return PURPLE_CMD_RET_FAILED;
+  }
+  if (!ya || !ya->archive) {
+    *error = g_strdup(_("The archive isn't open yet."));
+    return PURPLE_CMD_RET_FAILED;
+  }
+
+  matches = yggdrasil_index_search(ya->search, args[0]);
+  if (!yggdrasil_index_built(ya->search))
+    purple_conv_chat_write(chat, "",
+                           _("The archive is still being indexed; the latest "
+                             "lines aren't searched yet."),
+                           PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_NO_LOG,
+                           time(NULL));
+
+  /* the latest matches, oldest first */
+  shown = MIN(matches->len, YGGDRASIL_SEARCH_SHOW_MAX);
+  if (shown)
+    yggdrasil_archive_read_at(
+      ya->archive, &g_array_index(matches, gint64, matches->len - shown),
+      shown, show_archived_line, chat);
+
+  msg = g_strdup_printf(_("%u archived line(s) match \"%s\"; showing the "
+                          "latest %u."), matches->len, args[0], shown);
+  purple_conv_chat_write(chat, "", msg,
+                         PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_NO_LOG,
+                         time(NULL));
+  g_free(msg);
+  g_array_free(matches, TRUE);
+  return PURPLE_CMD_RET_OK;
+}
+
+/* /tracks <words>: searches the station's library */
+static PurpleCmdRet search_tracks(PurpleConversation *conv, const gchar *cmd,
+                                  gchar **args, gchar **error,
+                                  void *userdata) {
+  PurpleConnection *gc = purple_conversation_get_gc(conv);
+
+  if (!args[0] || !*args[0]) {
+    *error = g_strdup(_("Usage: tracks &lt;words&gt;"));
+    return PURPLE_CMD_RET_FAILED;
+  }
+  track_search(gc->proto_data, args[0]);
+  return PURPLE_CMD_RET_OK;
 }
 
 static PurpleCmdRet send_whisper(PurpleConversation *conv, const gchar *cmd,
@@ -1015,50 +2415,222 @@ static void yggdrasilprpl_chat_whisper(PurpleConnection *gc, int id, const char
                    message, time(NULL));
 }
 
+/*
+ * the local echo of a chat message. each receiving connection remembers it,
+ * so the station's copy isn't shown again when its poll brings it in.
+ */
 static void receive_chat_message(PurpleConvChat *from, PurpleConvChat *to,
                                  int id, const char *room, gpointer userdata) {
-  const char *message = (const char *)userdata;
+  YggdrasilWrite *write = (YggdrasilWrite *)userdata;
   PurpleConnection *to_gc = get_yggdrasilprpl_gc(to->nick);
+  YggdrasilConnection *to_ya = to_gc ? to_gc->proto_data : NULL;
 
   purple_debug_info(PLUGIN_DEBUG_NAME,
                     "%s receives message from %s in chat room %s: %s\n",
-                    to->nick, from->nick, room, message);
-  serv_got_chat_in(to_gc, id, from->nick, PURPLE_MESSAGE_RECV, message,
+                    to->nick, from->nick, room, write->message);
+  if (to_ya)
+    g_queue_push_tail(to_ya->echoes, yggdrasil_echo_new(write->echo_first,
+                                                        from->nick,
+                                                        write->message));
+  serv_got_chat_in(to_gc, id, from->nick, PURPLE_MESSAGE_RECV, write->message,
                    time(NULL));
 }
 
+static void write_free(YggdrasilWrite *write) {
+  write->ya->writes = g_list_remove(write->ya->writes, write);
+  g_free(write->message);
+  g_free(write);
+}
+
+/* a merged write: its messages will come back as one line, so their echoes
+ * are made into one */
+static void write_merge_echoes(YggdrasilWrite *write) {
+  GHashTableIter iter;
+  gpointer gc;
+
+  if (!registry_gcs)
+    return;
+  g_hash_table_iter_init(&iter, registry_gcs);
+  while (g_hash_table_iter_next(&iter, NULL, &gc)) {
+    YggdrasilConnection *ya = ((PurpleConnection *)gc)->proto_data;
+    yggdrasil_echo_merge(ya->echoes, write->ya->gc->account->username,
+                         write->echo_first, write->echo_last, write->message);
+  }
+}
+
+/* a write that won't make it: nobody is to wait for its echoes any more */
+static void write_fail(YggdrasilWrite *write) {
+  GHashTableIter iter;
+  gpointer gc;
+
+  if (registry_gcs) {
+    g_hash_table_iter_init(&iter, registry_gcs);
+    while (g_hash_table_iter_next(&iter, NULL, &gc)) {
+      YggdrasilConnection *ya = ((PurpleConnection *)gc)->proto_data;
+      yggdrasil_echo_forget(ya->echoes, write->ya->gc->account->username,
+                            write->echo_first, write->echo_last);
+    }
+  }
+  write_free(write);
+}
+
+static void write_cb(YggdrasilFetch *fetch, gpointer userdata,
+                     const char *body, gsize len, const char *error_message) {
+  YggdrasilWrite *write = (YggdrasilWrite *)userdata;
+  YggdrasilConnection *ya = write->ya;
+  PurpleConnection *gc = ya->gc;
+
+  write->fetch = NULL;
+  YGGDRASIL_METRIC_SINCE(YGGDRASIL_METRIC_SEND_SECONDS, write->sent_at);
+  if (error_message || !strstr(body, "OK"))
+    YGGDRASIL_METRIC(YGGDRASIL_METRIC_SEND_FAILURES, 1);
+
+  if (error_message) {
+    purple_debug_error(PLUGIN_DEBUG_NAME, "chatwrite failed: %s\n",
+                       error_message);
+    purple_notify_info(gc, _("Alert"), _("Alert"), _("chatwrite failed."));
+    write_fail(write);
+  } else if (!strstr(body, "OK") && !write->retried) {
+    /* the token was rejected; park the write and log in again */
+    purple_debug_info(PLUGIN_DEBUG_NAME,
+                      "chatwrite rejected, refreshing tokens for %s\n",
+                      gc->account->username);
+    write->retried = TRUE;
+    auth_cache_clear(gc->account);
+    if (!ya->login_fetch)
+      login_start(ya);
+    return;
+  } else if (!strstr(body, "OK")) {
+    purple_notify_info(gc, _("Alert"), _("Alert"), _("chatwrite failed."));
+    write_fail(write);
+  } else {
+    /* the line is on screen already; the next poll reconciles it */
+    write_free(write);
+  }
+
+  outbox_flush(ya);
+}
+
+static void write_send(YggdrasilWrite *write) {
+  char *escaped_message = url_encode(write->message);
+  char *write_url = g_strdup_printf(YGGDRASIL_URL_CHATWRITE,
+                                    write->ya->auth_chat, escaped_message);
+
+  write->fetch = yggdrasil_fetch(write_url, &yggdrasil_fetch_policy_write,
+                                 write_cb, write);
+  write->sent_at = YGGDRASIL_METRIC_NOW();
+  YGGDRASIL_METRIC(YGGDRASIL_METRIC_SENDS, 1);
+
+  g_free(write_url);
+  free(escaped_message);
+}
+
+static gboolean outbox_timer_cb(gpointer data) {
+  YggdrasilConnection *ya = (YggdrasilConnection *)data;
+  YGGDRASIL_STAGE_ENTER(YGGDRASIL_STAGE_SEND);
+  ya->send_timer = 0;
+  outbox_flush(ya);
+  YGGDRASIL_STAGE_LEAVE(YGGDRASIL_STAGE_SEND);
+  return FALSE;
+}
+
+/*
+ * sends the head of the outbox, folding in the messages queued behind it,
+ * as one chatwrite.php call. writes go out one at a time, so order is kept
+ * and whatever piles up meanwhile is merged into the next one.
+ */
+static void outbox_flush(YggdrasilConnection *ya) {
+  int burst = purple_account_get_int(ya->gc->account,
+                                     YGGDRASIL_SETTING_SEND_BURST,
+                                     YGGDRASIL_SEND_BURST);
+  gint64 now = g_get_monotonic_time();
+  YggdrasilWrite *write, *next;
+  GString *merged;
+  int count = 1;
+
+  if (ya->writes || ya->send_timer || g_queue_is_empty(ya->outbox))
+    return;
+
+  ya->send_tokens = MIN((double)MAX(burst, 1),
+                        ya->send_tokens + (now - ya->send_tokens_at) /
+                        (YGGDRASIL_SEND_INTERVAL * 1000.0));
+  ya->send_tokens_at = now;
+  if (ya->send_tokens < 1) {
+    ya->send_timer = purple_timeout_add(
+      (1 - ya->send_tokens) * YGGDRASIL_SEND_INTERVAL + 1, outbox_timer_cb, ya);
+    return;
+  }
+  ya->send_tokens -= 1;
+
+  write = g_queue_pop_head(ya->outbox);
+  merged = g_string_new(write->message);
+  while ((next = g_queue_peek_head(ya->outbox)) && next->id == write->id &&
+         merged->len + strlen(YGGDRASIL_WRITE_SEPARATOR) +
+           strlen(next->message) <= YGGDRASIL_WRITE_MAX_LEN) {
+    g_string_append(merged, YGGDRASIL_WRITE_SEPARATOR);
+    g_string_append(merged, next->message);
+    write->echo_last = next->echo_last;
+    write_free(g_queue_pop_head(ya->outbox));
+    count++;
+  }
+  g_free(write->message);
+  write->message = g_string_free(merged, FALSE);
+  if (count > 1)
+    write_merge_echoes(write);
+
+  ya->send_stats.writes++;
+  ya->send_stats.merged += count - 1;
+  purple_debug_info(PLUGIN_DEBUG_NAME,
+                    "chatwrite of %d message(s); %u queued, %u merged, "
+                    "%u dropped in %u writes\n", count,
+                    ya->send_stats.queued, ya->send_stats.merged,
+                    ya->send_stats.dropped, ya->send_stats.writes);
+
+  ya->writes = g_list_append(ya->writes, write);
+  /* a re-login is already underway; the write goes out once it's done */
+  if (!ya->login_fetch)
+    write_send(write);
+}
+
 static int yggdrasilprpl_chat_send(PurpleConnection *gc, int id, const char *message,
                               PurpleMessageFlags flags) {
-  char *send_chat_cmd;
-  char *escaped_message;
   const char *username = gc->account->username;
+  YggdrasilConnection *ya = gc->proto_data;
   PurpleConversation *conv = purple_find_chat(gc, id);
-  PurpleConvChat *chat;
-  int ret_val;
+  YggdrasilWrite *write;
 
   if (conv) {
     purple_debug_info(PLUGIN_DEBUG_NAME,
                       "%s is sending message to chat room %s: %s\n", username,
                       conv->name, message);
-    escaped_message = url_encode(message);
-    send_chat_cmd = g_strdup_printf(
-      "curl --silent \"http://yggdrasilradio.net/chatwrite.php?auth=%s&msg=%s\" | grep --silent 'OK'"
-      , AUTH_CHAT
-      , escaped_message
-    );
-    ret_val = system(send_chat_cmd);
-    if( ret_val ){
-      purple_notify_info(gc, _("Alert"), _("Alert"), _("chatwrite failed."));
-    }
-    g_free(send_chat_cmd);
 
-    /* send message to everyone in the chat room */
-    foreach_gc_in_chat(receive_chat_message, gc, id, (gpointer)message);
+    YGGDRASIL_STAGE_ENTER(YGGDRASIL_STAGE_SEND);
+    if (g_queue_get_length(ya->outbox) >= YGGDRASIL_OUTBOX_MAX) {
+      ya->send_stats.dropped++;
+      purple_conv_chat_write(purple_conversation_get_chat_data(conv), "",
+                             _("Too many messages waiting to be sent; "
+                               "message dropped."),
+                             PURPLE_MESSAGE_ERROR | PURPLE_MESSAGE_NO_LOG,
+                             time(NULL));
+      YGGDRASIL_STAGE_LEAVE(YGGDRASIL_STAGE_SEND);
+      return -1;
+    }
 
-    chatread();
-    chat = purple_conversation_get_chat_data(conv);
-    yggdrasilprpl_chat_update_convo(chat);
-    free(escaped_message);
+    write = g_new0(YggdrasilWrite, 1);
+    write->ya = ya;
+    write->id = id;
+    write->message = g_strdup(message);
+    if (++echo_serial == 0)
+      ++echo_serial;
+    write->echo_first = write->echo_last = echo_serial;
+
+    /* echo the message to everyone in the chat room */
+    foreach_gc_in_chat(receive_chat_message, gc, id, write);
+
+    g_queue_push_tail(ya->outbox, write);
+    ya->send_stats.queued++;
+    outbox_flush(ya);
+    YGGDRASIL_STAGE_LEAVE(YGGDRASIL_STAGE_SEND);
     return 0;
   } else {
     purple_debug_info(PLUGIN_DEBUG_NAME,
@@ -1167,63 +2739,125 @@ static void yggdrasilprpl_set_chat_topic(PurpleConnection *gc, int id,
   foreach_gc_in_chat(set_chat_topic_fn, gc, id, (gpointer)topic);
 }
 
-static gboolean yggdrasilprpl_finish_get_roomlist(gpointer roomlist) {
-  purple_roomlist_set_in_progress((PurpleRoomlist *)roomlist, FALSE);
-  return FALSE;
+/*
+ * the room list: the rooms open locally straight away, then the station's
+ * channels as channels.php answers, one "name|description" line each.
+ */
+static void roomlist_add(YggdrasilConnection *ya, const char *name,
+                         const char *description) {
+  PurpleRoomlistRoom *room;
+  int id;
+
+  /* each room is listed once, however many local accounts are in it */
+  if (!*name || g_hash_table_lookup(ya->roomlist_seen, name))
+    return;
+  g_hash_table_insert(ya->roomlist_seen, g_strdup(name), GINT_TO_POINTER(1));
+
+  id = g_str_hash(name);
+  purple_debug_info(PLUGIN_DEBUG_NAME, "listing room %s (%d)\n", name, id);
+
+  room = purple_roomlist_room_new(PURPLE_ROOMLIST_ROOMTYPE_ROOM, name, NULL);
+  purple_roomlist_room_add_field(ya->roomlist, room, name);
+  purple_roomlist_room_add_field(ya->roomlist, room, GINT_TO_POINTER(id));
+  purple_roomlist_room_add_field(ya->roomlist, room,
+                                 description ? description : "");
+  purple_roomlist_room_add(ya->roomlist, room);
 }
 
-static PurpleRoomlist *yggdrasilprpl_roomlist_get_list(PurpleConnection *gc) {
-  const char *username = gc->account->username;
-  PurpleRoomlist *roomlist = purple_roomlist_new(gc->account);
-  GList *fields = NULL;
-  PurpleRoomlistField *field;
-  GList *chats;
-  GList *seen_ids = NULL;
+static void roomlist_done(YggdrasilConnection *ya) {
+  if (ya->roomlist_fetch) {
+    yggdrasil_fetch_cancel(ya->roomlist_fetch);
+    ya->roomlist_fetch = NULL;
+  }
+  if (ya->roomlist) {
+    purple_roomlist_set_in_progress(ya->roomlist, FALSE);
+    purple_roomlist_unref(ya->roomlist);
+    ya->roomlist = NULL;
+  }
+  if (ya->roomlist_seen) {
+    g_hash_table_destroy(ya->roomlist_seen);
+    ya->roomlist_seen = NULL;
+  }
+}
 
-  purple_debug_info(PLUGIN_DEBUG_NAME, "%s asks for room list; returning:\n", username);
+static void roomlist_cb(YggdrasilFetch *fetch, gpointer userdata,
+                        const char *body, gsize len,
+                        const char *error_message) {
+  YggdrasilConnection *ya = (YggdrasilConnection *)userdata;
+  char **lines;
+  int i;
 
-  /* set up the room list */
-  field = purple_roomlist_field_new(PURPLE_ROOMLIST_FIELD_STRING, "room",
-                                    "room", TRUE /* hidden */);
-  fields = g_list_append(fields, field);
+  ya->roomlist_fetch = NULL;
+  if (error_message) {
+    purple_debug_error(PLUGIN_DEBUG_NAME, "channels failed: %s\n",
+                       error_message);
+    roomlist_done(ya);
+    return;
+  }
 
-  field = purple_roomlist_field_new(PURPLE_ROOMLIST_FIELD_INT, "Id", "Id", FALSE);
-  fields = g_list_append(fields, field);
+  lines = g_strsplit(body, "\n", -1);
+  for (i = 0; lines[i]; i++) {
+    char **fields = g_strsplit(lines[i], "|", 2);
+    if (fields[0])
+      roomlist_add(ya, g_strstrip(fields[0]),
+                   fields[1] ? g_strstrip(fields[1]) : NULL);
+    g_strfreev(fields);
+  }
+  g_strfreev(lines);
 
-  purple_roomlist_set_fields(roomlist, fields);
+  roomlist_done(ya);
+}
 
-  /* add each chat room. the chat ids are cached in seen_ids so that each room
-   * is only returned once, even if multiple users are in it. */
-  for (chats  = purple_get_chats(); chats; chats = g_list_next(chats)) {
-    PurpleConversation *conv = (PurpleConversation *)chats->data;
-    PurpleRoomlistRoom *room;
-    const char *name = conv->name;
-    int id = purple_conversation_get_chat_data(conv)->id;
+static PurpleRoomlist *yggdrasilprpl_roomlist_get_list(PurpleConnection *gc) {
+  YggdrasilConnection *ya = gc->proto_data;
+  GList *fields = NULL;
+  GList *chats;
 
-    /* have we already added this room? */
-    if (g_list_find_custom(seen_ids, name, (GCompareFunc)strcmp))
-      continue;                                /* yes! try the next one. */
+  purple_debug_info(PLUGIN_DEBUG_NAME, "%s asks for room list\n",
+                    gc->account->username);
 
-    /* This cast is OK because this list is only staying around for the life
-     * of this function and none of the conversations are being deleted
-     * in that timespan. */
-    seen_ids = g_list_prepend(seen_ids, (char *)name); /* no, it's new. */
-    purple_debug_info(PLUGIN_DEBUG_NAME, "%s (%d), ", name, id);
+  /* a new request replaces one still being filled in */
+  roomlist_done(ya);
+  ya->roomlist = purple_roomlist_new(gc->account);
+  ya->roomlist_seen = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                            g_free, NULL);
 
-    room = purple_roomlist_room_new(PURPLE_ROOMLIST_ROOMTYPE_ROOM, name, NULL);
-    purple_roomlist_room_add_field(roomlist, room, name);
-    purple_roomlist_room_add_field(roomlist, room, &id);
-    purple_roomlist_room_add(roomlist, room);
+  /* set up the room list */
+  fields = g_list_append(fields, purple_roomlist_field_new(
+    PURPLE_ROOMLIST_FIELD_STRING, "room", "room", TRUE /* hidden */));
+  fields = g_list_append(fields, purple_roomlist_field_new(
+    PURPLE_ROOMLIST_FIELD_INT, "Id", "Id", FALSE));
+  fields = g_list_append(fields, purple_roomlist_field_new(
+    PURPLE_ROOMLIST_FIELD_STRING, _("Description"), "description", FALSE));
+  purple_roomlist_set_fields(ya->roomlist, fields);
+  purple_roomlist_set_in_progress(ya->roomlist, TRUE);
+
+  roomlist_add(ya, "Yggdrasil Intercom", NULL);
+  for (chats = purple_get_chats(); chats; chats = g_list_next(chats)) {
+    PurpleConversation *conv = (PurpleConversation *)chats->data;
+    if (conv->account->gc && conv->account->gc->proto_data &&
+        !strcmp(conv->account->protocol_id, YGGDRASILPRPL_ID))
+      roomlist_add(ya, conv->name, NULL);
   }
 
-  g_list_free(seen_ids);
-  purple_timeout_add(1 /* ms */, yggdrasilprpl_finish_get_roomlist, roomlist);
-  return roomlist;
+  ya->roomlist_fetch = yggdrasil_fetch(YGGDRASIL_URL_CHANNELS,
+                                       &yggdrasil_fetch_policy_poll,
+                                       roomlist_cb, ya);
+
+  /* purple drops its reference when the dialog closes; ours goes when the
+   * list is complete */
+  purple_roomlist_ref(ya->roomlist);
+  return ya->roomlist;
 }
 
 static void yggdrasilprpl_roomlist_cancel(PurpleRoomlist *list) {
- purple_debug_info(PLUGIN_DEBUG_NAME, "%s asked to cancel room list request\n",
-                   list->account->username);
+  PurpleConnection *gc = purple_account_get_connection(list->account);
+
+  purple_debug_info(PLUGIN_DEBUG_NAME, "%s asked to cancel room list request\n",
+                    list->account->username);
+  if (gc && gc->proto_data &&
+      ((YggdrasilConnection *)gc->proto_data)->roomlist == list)
+    roomlist_done(gc->proto_data);
 }
 
 static void yggdrasilprpl_roomlist_expand_category(PurpleRoomlist *list,
@@ -1336,18 +2970,48 @@ static PurplePluginProtocolInfo prpl_info =
   NULL                                 /* add_buddies_with_invite */
 };
 
-static void yggdrasilprpl_init(PurplePlugin *plugin)
-{
-  int ret;
-  /* see accountopt.h for information about user splits and protocol options */
-  PurpleAccountOption *option = purple_account_option_string_new(
-    _("Example option"),      /* text shown to user */
-    "example",                /* pref name */
-    "default");               /* default value */
+/*
+ * the core runs on the purple event loop and logs to the purple debug window
+ */
+static guint core_input_add(int fd, YggdrasilInputCondition cond,
+                            YggdrasilInputFunction func, gpointer data) {
+  /* YggdrasilInputCondition has PurpleInputCondition's values */
+  return purple_input_add(fd, (PurpleInputCondition)cond,
+                          (PurpleInputFunction)func, data);
+}
 
-  purple_debug_info(PLUGIN_DEBUG_NAME, "starting up\n");
+static void core_debug(gboolean error, const char *message) {
+  if (error)
+    purple_debug_error(PLUGIN_DEBUG_NAME, "%s", message);
+  else
+    purple_debug_info(PLUGIN_DEBUG_NAME, "%s", message);
+}
+
+static const YggdrasilCoreOps core_ops = {
+  purple_timeout_add,
+  purple_timeout_add_seconds,
+  purple_timeout_remove,
+  core_input_add,
+  purple_input_remove,
+  core_debug,
+  breaker_changed,
+  "yggdrasilprpl/" DISPLAY_VERSION
+};
 
-  prpl_info.protocol_options = g_list_append(NULL, option);
+/*
+ * everything the plugin needs once an account is in use: the core (and with
+ * it libcurl), the chat commands and the signal handlers. deferred from
+ * yggdrasilprpl_init to the first login, so that loading the plugin without
+ * a yggdrasil account costs nothing.
+ */
+static gboolean started = FALSE;
+
+static void yggdrasilprpl_start(void) {
+  if (started)
+    return;
+  started = TRUE;
+
+  purple_debug_info(PLUGIN_DEBUG_NAME, "starting up\n");
 
   /* register whisper chat command, /msg */
   purple_cmd_register("msg",
@@ -1359,19 +3023,109 @@ static void yggdrasilprpl_init(PurplePlugin *plugin)
                     "msg &lt;username&gt; &lt;message&gt;: send a private message, aka a whisper",
                     NULL);                 /* userdata */
 
+  /* register archive search chat command, /search */
+  purple_cmd_register("search",
+                    "s",                   /* args: words to look for */
+                    PURPLE_CMD_P_DEFAULT,  /* priority */
+                    PURPLE_CMD_FLAG_CHAT | PURPLE_CMD_FLAG_PRPL_ONLY,
+                    "prpl-yggdrasil",
+                    search_archive,
+                    "search &lt;words&gt;: show the latest archived lines containing all of the words",
+                    NULL);                 /* userdata */
+
+  /* register track search chat command, /tracks */
+  purple_cmd_register("tracks",
+                    "s",                   /* args: words to look for */
+                    PURPLE_CMD_P_DEFAULT,  /* priority */
+                    PURPLE_CMD_FLAG_CHAT | PURPLE_CMD_FLAG_PRPL_ONLY,
+                    "prpl-yggdrasil",
+                    search_tracks,
+                    "tracks &lt;words&gt;: search the station's library",
+                    NULL);                 /* userdata */
+
+  /* register archive chat command, /archive */
+  purple_cmd_register("archive",
+                    "ww",                  /* args: hours ago and hours */
+                    PURPLE_CMD_P_DEFAULT,  /* priority */
+                    PURPLE_CMD_FLAG_CHAT | PURPLE_CMD_FLAG_PRPL_ONLY |
+                    PURPLE_CMD_FLAG_ALLOW_WRONG_ARGS,
+                    "prpl-yggdrasil",
+                    show_archive,
+                    "archive [hours ago] [hours]: show the archived intercom, by default the hour starting a day ago",
+                    NULL);                 /* userdata */
+
+  /* register track history chat command, /played */
+  purple_cmd_register("played",
+                    "w",                   /* args: how many */
+                    PURPLE_CMD_P_DEFAULT,  /* priority */
+                    PURPLE_CMD_FLAG_CHAT | PURPLE_CMD_FLAG_PRPL_ONLY |
+                    PURPLE_CMD_FLAG_ALLOW_WRONG_ARGS,
+                    "prpl-yggdrasil",
+                    show_played,
+                    "played [count]: list the latest tracks played on the station",
+                    NULL);                 /* userdata */
+
+  /* poll at full rate only while someone is watching the intercom */
+  purple_signal_connect(purple_conversations_get_handle(),
+                        "conversation-updated", _yggdrasil_protocol,
+                        PURPLE_CALLBACK(conversation_updated_cb), NULL);
+
   /* get ready to store offline messages */
   goffline_messages = g_hash_table_new_full(g_str_hash,  /* hash fn */
                                             g_str_equal, /* key comparison fn */
                                             g_free,      /* key free fn */
                                             NULL);       /* value free fn */
 
-  ret = system("echo '' > /tmp/yggdrasil.chat.log.txt");
-  if(ret) printf("problem?");
+  yggdrasil_core_init(&core_ops);
+}
+
+static void yggdrasilprpl_init(PurplePlugin *plugin)
+{
+  /* see accountopt.h for information about user splits and protocol options */
+  PurpleAccountOption *option = purple_account_option_string_new(
+    _("Example option"),      /* text shown to user */
+    "example",                /* pref name */
+    "default");               /* default value */
+
+  prpl_info.protocol_options = g_list_append(NULL, option);
+
+  option = purple_account_option_int_new(
+    _("Messages sent in a burst before rate limiting"),
+    YGGDRASIL_SETTING_SEND_BURST,
+    YGGDRASIL_SEND_BURST);
+  prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+                                             option);
+
+  /*
+   * emitted when the topic names another track, with the account, artist,
+   * title and show (artist and show may be NULL). registered here rather
+   * than in yggdrasilprpl_start so other plugins can connect on load.
+   */
+  purple_signal_register(plugin, "yggdrasil-track-changed",
+                         purple_marshal_VOID__POINTER_POINTER_POINTER_POINTER,
+                         NULL, 4,
+                         purple_value_new(PURPLE_TYPE_SUBTYPE,
+                                          PURPLE_SUBTYPE_ACCOUNT),
+                         purple_value_new(PURPLE_TYPE_STRING),
+                         purple_value_new(PURPLE_TYPE_STRING),
+                         purple_value_new(PURPLE_TYPE_STRING));
+
   _yggdrasil_protocol = plugin;
 }
 
 static void yggdrasilprpl_destroy(PurplePlugin *plugin) {
   purple_debug_info(PLUGIN_DEBUG_NAME, "shutting down\n");
+
+  if (registry_gcs) {
+    g_hash_table_destroy(registry_gcs);
+    registry_gcs = NULL;
+  }
+  if (registry_chats) {
+    g_hash_table_destroy(registry_chats);
+    registry_chats = NULL;
+  }
+  if (started)
+    yggdrasil_core_shutdown();
 }
 
 